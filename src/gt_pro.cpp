@@ -13,6 +13,9 @@
 #define _MAP_POPULATE_empty
 #endif
 #define __STDC_FORMAT_MACROS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #endif
 
 #ifdef _MAP_POPULATE_empty
@@ -23,8 +26,11 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h> // for PRId64
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -32,13 +38,18 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <condition_variable>
 #include <cstdint>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <libgen.h>
 #include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <regex>
@@ -90,15 +101,25 @@ constexpr auto SNP_MAX_VID = (LSB << SNP_VID_BITS) - LSB;
 constexpr auto SNP_REAL_ID_BITS = 64 - SNP_VID_BITS;
 constexpr auto SNP_MAX_REAL_ID = (LSB << SNP_REAL_ID_BITS) - LSB;
 
+// The species id is the leading 6 decimal digits of a real SNP id;  see get_species in sckmerdb_build.
+uint64_t snp_species(uint64_t real_snp_id) {
+  while (real_snp_id >= 1000000) {
+    real_snp_id /= 10;
+  }
+  return real_snp_id;
+}
+
 // This param is only useful for perf testing.  The setting below, not
 // to exceed 64 TB of RAM, is equivalent to infinity in 2019.
 constexpr auto MAX_MMAP_GB = 64 * 1024;
 constexpr auto MAX_END = MAX_MMAP_GB * (LSB << 30) / 8;
 
 // Ordered by preference, i.e. the best performing ones are at the top.
+// BAM is BGZF compressed, which any gzip decompressor reads;  bgzip decompresses blocks in parallel.
 const char *compressors[][3] = {
-    {".lz4", "lz4", "untested"}, {".bz2", "lbzip2", "untested"}, {".bz2", "bzip2", "untested"},
-    {".gz", "pigz", "untested"}, {".gz", "gzip", "untested"},
+    {".lz4", "lz4", "untested"},       {".bz2", "lbzip2", "untested"}, {".bz2", "bzip2", "untested"},
+    {".gz", "pigz", "untested"},       {".gz", "gzip", "untested"},    {".bam", "bgzip -@ 4", "untested"},
+    {".bam", "pigz", "untested"},      {".bam", "gzip", "untested"},
 };
 
 extern int errno;
@@ -108,6 +129,12 @@ long chrono_time() {
   return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
 }
 
+// Monotonic microseconds, for measuring short intervals.
+long steady_time_us() {
+  using namespace chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
 struct Command {
   bool success;
   int exit_code;
@@ -186,6 +213,7 @@ double system_ram(const bool quiet=false, const double default_result=0.0) {
 // That is, based on the test result matrix, choose values that are expected to
 // perform best for the amount of RAM that would be left on the current
 // system after loading the current DB in filesystem cache.
+// Each (l, m) pair below has a specialized query kernel;  see kmer_lookup_chunk.
 bool choose_optimal_l_and_m(int& l, int& m, double db_size, bool explicit_l_and_m) {
   bool success = true;
   const auto ram_gb = system_ram(explicit_l_and_m);
@@ -299,7 +327,7 @@ int decompressor(const char *inpath) {
         required = i;
       }
       if (0 == strcmp(comp[2], "tested_and_works")) {
-        return required;
+        return i;
       }
     }
     ++i;
@@ -312,6 +340,9 @@ string chopext(string path, int decomp_idx) {
   if (decomp_idx != -1) {
     auto &comp = compressors[decomp_idx];
     path = path.substr(0, path.size() - strlen(comp[0]));
+    if (0 == strcmp(comp[0], ".bam")) {
+      return path; // .bam is the format extension as well
+    }
   }
   // Next chop off whatever other extension there is, probably .fq or .fastq
   auto last_dot = path.find_last_of(".");
@@ -386,6 +417,29 @@ size_t get_fsize(const char *filename) {
   return st.st_size;
 }
 
+// Canonical path, size and modification time of a file, for a cache derived from it to tell
+// whether it still matches;  empty if the file is missing.
+string file_key(const string &path) {
+  struct stat st;
+  char *resolved = realpath(path.c_str(), NULL);
+  if (!(resolved) || stat(resolved, &st) == -1) {
+    free(resolved);
+    errno = 0;
+    return "";
+  }
+  ostringstream key;
+  key << resolved << ' ' << st.st_size << ' ' << st.st_mtime;
+  free(resolved);
+  return key.str();
+}
+
+// The key of the optimized DB whose bin files start with db_prefix;  empty unless both exist.
+string db_files_key(const string &db_prefix) {
+  const auto snps_key = file_key(db_prefix + "_optimized_db_snps.bin");
+  const auto kmers_key = file_key(db_prefix + "_optimized_db_kmer_index.bin");
+  return snps_key.empty() || kmers_key.empty() ? "" : snps_key + "\t" + kmers_key;
+}
+
 struct CodeDict {
   vector<uint8_t> code_dict;
   uint8_t *data;
@@ -450,190 +504,582 @@ const ElementType *find_last(const ElementType *first, const ElementType *last,
   return NULL;
 }
 
-int64_t kmer_lookup_chunk(vector<uint64_t> *kmer_matches, const LmerRange *const lmer_index, const uint64_t *const mmer_bloom,
-                          const uint32_t *const kmers_index, const uint64_t *const snps, const char *const window,
-                          const int bytes_in_chunk, const int M2, const int M3, const string &in_path, const long s_start) {
+// The query kernel below is parameterized by the index geometry.  For the handful of (L2, M3)
+// pairs that choose_optimal_l_and_m can pick, the geometry is a compile-time constant, so the
+// compiler can fold all the shifts and masks.  Any other -l/-m falls back to RuntimeGeometry.
+template <int L2, int M3> struct StaticGeometry {
+  static_assert(0 < L2 && L2 <= 32 && 0 < M3 && M3 < 64, "Unsupported index geometry.");
+  static constexpr int m2() { return K2 - L2; }
+  static constexpr int m3() { return M3; }
+};
 
-  const uint64_t MAX_BLOOM = (LSB << M3) - LSB;
+struct RuntimeGeometry {
+  const int M2;
+  const int M3;
+  RuntimeGeometry(const int M2, const int M3) : M2(M2), M3(M3) {}
+  int m2() const { return M2; }
+  int m3() const { return M3; }
+};
 
-  // Reads that contain wildcard characters ('N' or 'n') are split into
-  // tokens at those wildcard characters.  Each token is processed as
-  // though it were a separate read.
-  constexpr int MAX_TOKEN_LENGTH = 500;
-  constexpr int MIN_TOKEN_LENGTH = 31;
+// Pipeline stages, for attributing hardware events under --perf-counters.  The first four
+// run inside the query kernel, in this order, for every k-mer.
+enum QueryStage {
+  STAGE_PARSE,
+  STAGE_BLOOM_PROBE,
+  STAGE_LMER_PROBE,
+  STAGE_CANDIDATE_VERIFY,
+  STAGE_OUTPUT_SORT,
+  N_STAGES
+};
+const char *stage_names[N_STAGES] = {"parse", "bloom_probe", "lmer_probe", "candidate_verify", "output_sort"};
+
+// Hot path counters for one query task.  Each task fills its own instance, so no synchronization
+// is needed until the task adds its totals to PerfCounters.  When counters are not requested the
+// kernel is instantiated with NoQueryCounters, whose methods compile away.
+//
+// Setting last_stage short of STAGE_CANDIDATE_VERIFY makes the kernel stop work on each k-mer
+// after that stage, which is how --perf-counters isolates the cost of each stage.
+struct QueryCounters {
+  uint64_t kmers;
+  uint64_t bloom_passes;
+  uint64_t lmer_probes;
+  uint64_t bucket_entries;
+  uint64_t matches;
+  uint64_t kmer_checksum; // keeps truncated passes from being optimized away
+  int stop_after;
+  QueryCounters(const int stop_after = STAGE_CANDIDATE_VERIFY)
+      : kmers(0), bloom_passes(0), lmer_probes(0), bucket_entries(0), matches(0), kmer_checksum(0), stop_after(stop_after) {}
+  int last_stage() const { return stop_after; }
+  void count_kmer(const uint64_t kmer) {
+    ++kmers;
+    kmer_checksum ^= kmer;
+  }
+  void count_bloom_pass() { ++bloom_passes; }
+  void count_lmer_probe(const uint64_t bucket_length) {
+    ++lmer_probes;
+    bucket_entries += bucket_length;
+  }
+  void count_match() { ++matches; }
+};
+
+struct NoQueryCounters {
+  static constexpr int last_stage() { return STAGE_CANDIDATE_VERIFY; }
+  void count_kmer(const uint64_t) {}
+  void count_bloom_pass() {}
+  void count_lmer_probe(const uint64_t) {}
+  void count_match() {}
+};
+
+// Inputs may be FASTQ or FASTA, told apart by the first character of the file, or BAM, told by
+// the .bam extension.
+enum InputFormat { FORMAT_UNKNOWN, FORMAT_FASTQ, FORMAT_FASTA, FORMAT_BAM };
 
-  // This ranges from 0 to the length of the longest read (could exceed MAX_TOKEN_LENGTH).
-  int token_length = 0;
-  char c = '\0';
+InputFormat detect_format(const char *window, const uint64_t bytes_in_window) {
+  if (bytes_in_window == 0) {
+    return FORMAT_UNKNOWN;
+  }
+  if (window[0] == '@') {
+    return FORMAT_FASTQ;
+  }
+  if (window[0] == '>') {
+    return FORMAT_FASTA;
+  }
+  return FORMAT_UNKNOWN;
+}
 
-  int n_lines = 0;
+bool is_bam_path(const string &path) {
+  return path.size() > 4 && 0 == strcasecmp(path.c_str() + path.size() - 4, ".bam");
+}
 
-  char seq_buf[MAX_TOKEN_LENGTH];
-  unordered_map<uint64_t, int> footprint;
+inline uint16_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+inline uint32_t le32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24); }
+
+// BAM packs bases in 4 bits, indexing "=ACMGRSVTWYHKDBN".  Map them to the 2-bit codes of
+// seq_encode;  ambiguity codes map to 0xff and split tokens, like 'N' in FASTQ.
+const uint8_t bam_base_codes[16] = {0xff, 0, 1, 0xff, 2, 0xff, 0xff, 0xff, 3, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+// One alignment record of a decompressed BAM stream, as laid out in the SAM/BAM specification.
+struct BamRecord {
+  uint64_t size; // bytes, including the block_size field
+  uint16_t flag;
+  int32_t l_seq;
+  const char *read_name; // l_read_name - 1 characters, then NUL
+  uint8_t l_read_name;
+  const uint8_t *seq; // two bases per byte, first base in the high nibble
+  // Whether bytes hold the whole record that starts at data.
+  static bool whole(const char *data, const uint64_t bytes) {
+    return bytes >= 4 && bytes - 4 >= le32((const uint8_t *)data);
+  }
+  // Returns false unless a whole, well formed record starts at data.
+  bool parse(const char *data, const uint64_t bytes) {
+    const auto p = (const uint8_t *)data;
+    if (!(whole(data, bytes))) {
+      return false;
+    }
+    const uint64_t block_size = le32(p);
+    if (block_size < 32) {
+      return false;
+    }
+    l_read_name = p[4 + 8];
+    const uint16_t n_cigar_op = le16(p + 4 + 12);
+    flag = le16(p + 4 + 14);
+    l_seq = int32_t(le32(p + 4 + 16));
+    const uint64_t seq_offset = 4 + 32 + l_read_name + 4 * uint64_t(n_cigar_op);
+    if (l_seq < 0 || seq_offset + (uint64_t(l_seq) + 1) / 2 + l_seq > 4 + block_size) {
+      return false;
+    }
+    read_name = data + 4 + 32;
+    seq = p + seq_offset;
+    size = 4 + block_size;
+    return true;
+  }
+  // Secondary and supplementary alignments repeat (part of) a read that has a primary record.
+  bool primary() const { return !(flag & 0x900); }
+};
 
-  for (int i = 0; i < bytes_in_chunk; ++i) {
+// Consume the header of a decompressed BAM stream, up to the first record.  Returns false if the
+// stream does not start with a whole BAM header.
+bool skip_bam_header(FILE *f, uint64_t &bytes_read) {
+  uint8_t word[4];
+  auto read_word = [&]() {
+    const auto ok = (fread(word, 1, 4, f) == 4);
+    bytes_read += 4;
+    return ok;
+  };
+  auto skip = [&](uint64_t n) {
+    char buf[4096];
+    while (n) {
+      const auto len = min<uint64_t>(n, sizeof(buf));
+      if (fread(buf, 1, len, f) != len) {
+        return false;
+      }
+      bytes_read += len;
+      n -= len;
+    }
+    return true;
+  };
+  if (!(read_word()) || 0 != memcmp(word, "BAM\1", 4)) {
+    return false;
+  }
+  if (!(read_word()) || !(skip(le32(word)))) { // l_text, text
+    return false;
+  }
+  if (!(read_word())) { // n_ref
+    return false;
+  }
+  for (uint32_t n_ref = le32(word), i = 0; i < n_ref; ++i) {
+    if (!(read_word()) || !(skip(le32(word))) || !(read_word())) { // l_name, name, l_ref
+      return false;
+    }
+  }
+  return true;
+}
 
-    // c is the character preceding window[i]
-    if (c == '\n') {
-      ++n_lines;
-      // The first character on the read header must be @
-      if (n_lines % 4 == 0 && window[i] != '@') {
-        return -i; // here i >= 1
+// Classifies the lines of FASTQ or FASTA records, one line at a time, in order.
+//
+// A sequence may span any number of lines in either format.  In FASTA, a sequence ends where
+// the next header begins.  In FASTQ, the sequence ends at the '+' separator line, and the quality
+// string after it may span lines as well, so it cannot be told apart from the next header by its
+// first character:  quality strings may start with '@' or '+'.  Instead, the record ends once as
+// many quality characters as sequence characters have been seen.  For ordinary 4-line FASTQ this
+// accepts exactly what the 4-line rules would.
+struct FastxParser {
+  enum Line { HEADER, SEQUENCE, SEPARATOR, QUALITY, BLANK, MALFORMED };
+  const InputFormat format;
+  enum { EXPECT_HEADER, IN_SEQUENCE, IN_QUALITY } state;
+  uint64_t seq_length;
+  uint64_t qual_length;
+  FastxParser(const InputFormat format) : format(format), state(EXPECT_HEADER), seq_length(0), qual_length(0) {}
+  // The line is [line, eol), without its newline character.
+  Line next_line(const char *line, const char *eol) {
+    const char first = (line < eol) ? *line : '\n';
+    switch (state) {
+    case EXPECT_HEADER:
+      if (first == '\n') {
+        return BLANK;
+      }
+      if (first != (format == FORMAT_FASTA ? '>' : '@')) {
+        return MALFORMED;
+      }
+      state = IN_SEQUENCE;
+      seq_length = 0;
+      return HEADER;
+    case IN_SEQUENCE:
+      if (format == FORMAT_FASTA && first == '>') {
+        seq_length = 0;
+        return HEADER;
+      }
+      if (format == FORMAT_FASTQ && first == '+') {
+        state = IN_QUALITY;
+        qual_length = 0;
+        return SEPARATOR;
+      }
+      seq_length += eol - line;
+      return SEQUENCE;
+    case IN_QUALITY:
+      // An empty sequence still has its (empty) quality line.
+      qual_length += eol - line;
+      if (qual_length > seq_length) {
+        return MALFORMED;
       }
-      // Similar rule from the fastq spec.
-      if (n_lines % 4 == 2 && window[i] != '+') {
-        return -i;
+      if (qual_length == seq_length) {
+        state = EXPECT_HEADER;
       }
+      return QUALITY;
     }
+    return MALFORMED;
+  }
+  // True between records, i.e. when the last line seen completed a FASTQ record.  FASTA records
+  // are never known to be complete until the next header.
+  bool between_records() const { return state == EXPECT_HEADER; }
+};
+
+// The MurmurHash3 finalizer, to spread the bits of a weak hash or an id.
+uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
 
-    // Invariant:  The number of new line characters consumed before window[i]
-    // is the value of n_lines.
+// Hash of a read name, up to the first whitespace, for --subsample.  A read keeps its name
+// wherever it lands in a segment, so sampling by this hash does not depend on segment boundaries.
+uint64_t read_name_hash(const char *name, const char *end) {
+  uint64_t h = 14695981039346656037ULL; // FNV-1a
+  for (const char *p = name; p < end && !(isspace((uint8_t)*p)); ++p) {
+    h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+  }
+  return mix64(h);
+}
 
-    c = window[i];
+template <class Geometry, class Counters>
+int64_t kmer_lookup_chunk_impl(vector<uint64_t> *kmer_matches, const LmerRange *const lmer_index,
+                               const uint64_t *const mmer_bloom, const uint32_t *const kmers_index,
+                               const uint64_t *const snps, const char *const window, const uint64_t bytes_in_chunk,
+                               const Geometry &geometry, Counters &counters, const int reads_per_fragment,
+                               const InputFormat format, const uint64_t sample_limit, vector<uint64_t> *sampled) {
 
-    // In FASTQ format, every 4 lines define a read.  The first line is the
-    // read header.  The next line is the read sequence.  We only care about
-    // the read sequence, where n_lines % 4 == 1.
-    if (n_lines % 4 != 1) {
-      // The current line does *not* contain a read sequence.
-      // Next character, please.
-      continue;
+  const auto M2 = geometry.m2();
+  const uint64_t MAX_BLOOM = (LSB << geometry.m3()) - LSB;
+
+  // Sequences that contain wildcard characters ('N' or 'n') are split into
+  // tokens at those wildcard characters.  Each token is processed as
+  // though it were a separate read.  K-mers are encoded incrementally as the
+  // sequence streams by, so neither line breaks nor token length matter.
+  uint64_t kmer_tuple[2] = {0, 0}; // forward and reverse complement of the last K bases;  see seq_encode
+  int token_length = 0;            // saturates at K
+
+  int64_t n_records = 0;
+
+  // Under --subsample, a fragment is kept if the hash of its first read's name is at most
+  // sample_limit, and the reads of other fragments are skipped without extracting k-mers.
+  const bool subsampling = sample_limit != UINT64_MAX || sampled != NULL;
+  bool skipping = false;
+  uint64_t fragment_hash = 0;
+  int64_t n_kept = 0;
+
+  // Each SNP counts at most once per fragment (read, or pair of mates).  Matches for the current
+  // fragment are appended from fragment_start on, skipping repeats of the last match, which is how
+  // overlapping k-mers usually repeat;  other repeats are removed when the fragment ends.  Unlike a
+  // hash set, this costs nothing per fragment without matches, and scales to long reads with
+  // thousands of them.
+  // With sampled, each kept fragment appends its name hash and its number of matches there.
+  uint64_t fragment_start = kmer_matches->size();
+  auto end_fragment = [&]() {
+    if (kmer_matches->size() - fragment_start > 1) {
+      const auto first = kmer_matches->begin() + fragment_start;
+      sort(first, kmer_matches->end());
+      kmer_matches->erase(unique(first, kmer_matches->end()), kmer_matches->end());
+    }
+    if (sampled && n_records > 0 && !(skipping)) {
+      sampled->push_back(fragment_hash);
+      sampled->push_back(kmer_matches->size() - fragment_start);
     }
+    fragment_start = kmer_matches->size();
+  };
 
-    // The current line contains a read sequence.  Split it into tokens at wildcard 'N'
-    // characters.  Buffer current token in seq_buf[0...MAX_READ_LENGTH-1].
-    const bool at_token_end = (c == '\n') || (c == 'N') || (c == 'n');
-    if (!(at_token_end)) {
-      // Invariant:  The current token length is token_length.
-      // Only the first MAX_TOKEN_LENGTH charaters of the token are retained.
-      if (token_length < MAX_TOKEN_LENGTH) {
-        seq_buf[token_length] = c;
-      }
+  // Feed the next base of a token, as a 2-bit code, to the k-mer encoder, and look up the k-mer
+  // that ends with it.
+  auto next_base = [&](const uint8_t b_code) {
+    kmer_tuple[0] = (kmer_tuple[0] >> BITS_PER_BASE) | ((uint64_t)b_code << (K2 - BITS_PER_BASE));
+    kmer_tuple[1] = ((kmer_tuple[1] << BITS_PER_BASE) | (b_code ^ 3)) & FULL_KMER;
+    if (token_length < K) {
       ++token_length;
-      // next character, please
-      continue;
+      if (token_length < K) {
+        return;
+      }
     }
 
-    // is token length within acceptable bounds?   if not, token will be dropped silently
-    if (MIN_TOKEN_LENGTH <= token_length && token_length <= MAX_TOKEN_LENGTH) {
+    // This kmer_tuple encodes the forward and reverse kmers ending at the new base.
+    const uint64_t kmer = min(kmer_tuple[0], kmer_tuple[1]);
+    counters.count_kmer(kmer);
+    if (counters.last_stage() == STAGE_PARSE) {
+      return;
+    }
 
-      // yes, process token
-      for (int j = 0; j <= token_length - K; ++j) {
+    if ((mmer_bloom[(kmer & MAX_BLOOM) / 64] >> (kmer % 64)) & 1) {
+      counters.count_bloom_pass();
+      if (counters.last_stage() == STAGE_BLOOM_PROBE) {
+        return;
+      }
 
-        // This kmer_tuple encodes the forward and reverse kmers at seq_buf[j...]
-        uint64_t kmer_tuple[2];
-        const auto malformed_dna = seq_encode<uint64_t, K>(kmer_tuple, seq_buf + j);
-        if (malformed_dna) {
-          return -(i - token_length);
-        }
-        const uint64_t kmer = min(kmer_tuple[0], kmer_tuple[1]);
-
-        if ((mmer_bloom[(kmer & MAX_BLOOM) / 64] >> (kmer % 64)) & 1) {
-
-          const uint32_t lmer = kmer >> M2;
-          const auto range = lmer_index[lmer];
-          const auto start = range >> LEN_BITS;
-          const auto end = min(MAX_END, start + (range & MAX_LEN));
-          for (uint64_t z = start; z < end; ++z) {
-            const auto kmi = kmers_index[z];
-            const auto offset = kmi & 0x1f;
-            const auto snp_id = kmi >> 5;
-            const auto snp_repr = snps + 3 * snp_id;
-            const auto low_bits = snp_repr[0] >> (62 - (offset * BITS_PER_BASE));
-            const auto high_bits = (snp_repr[1] << (offset * BITS_PER_BASE)) & FULL_KMER;
-            const auto db_kmer = high_bits | low_bits;
-            // The assert below is true but might be a bit slow due to reverse_complement.
-            // TODO: instead of calling reverse_complement() consider using kmer_rc
-            // assert(lmer == (db_kmer >> M2) || lmer == (reverse_complement(db_kmer) >> M2));
-            if (kmer_tuple[0] == db_kmer || kmer_tuple[1] == db_kmer) {
-              // The set of kmers that cover the SNP within the given read won't conflict
-              // with each other, but may still belong to different virtual SNPs.  We need
-              // to identify the real SNP they all belong to, and increment the real SNP's
-              // counter just once for the read.
-              const auto snp = snp_repr[2] & SNP_MAX_REAL_ID;
-              if (footprint.find(snp) == footprint.end()) {
-                kmer_matches->push_back(snp);
-                footprint.insert({snp, 1});
-              }
-            }
+      const uint32_t lmer = kmer >> M2;
+      const auto range = lmer_index[lmer];
+      const auto start = range >> LEN_BITS;
+      const auto end = min(MAX_END, start + (range & MAX_LEN));
+      counters.count_lmer_probe(end - start);
+      if (counters.last_stage() == STAGE_LMER_PROBE) {
+        return;
+      }
+      for (uint64_t z = start; z < end; ++z) {
+        const auto kmi = kmers_index[z];
+        const auto offset = kmi & 0x1f;
+        const auto snp_id = kmi >> 5;
+        const auto snp_repr = snps + 3 * snp_id;
+        const auto low_bits = snp_repr[0] >> (62 - (offset * BITS_PER_BASE));
+        const auto high_bits = (snp_repr[1] << (offset * BITS_PER_BASE)) & FULL_KMER;
+        const auto db_kmer = high_bits | low_bits;
+        // The assert below is true but might be a bit slow due to reverse_complement.
+        // TODO: instead of calling reverse_complement() consider using kmer_rc
+        // assert(lmer == (db_kmer >> M2) || lmer == (reverse_complement(db_kmer) >> M2));
+        if (kmer_tuple[0] == db_kmer || kmer_tuple[1] == db_kmer) {
+          counters.count_match();
+          // The set of kmers that cover the SNP within the given read won't conflict
+          // with each other, but may still belong to different virtual SNPs.  We need
+          // to identify the real SNP they all belong to, and increment the real SNP's
+          // counter just once for the read.
+          const auto snp = snp_repr[2] & SNP_MAX_REAL_ID;
+          if (kmer_matches->size() == fragment_start || kmer_matches->back() != snp) {
+            kmer_matches->push_back(snp);
           }
         }
       }
     }
+  };
 
-    // clear footprint for every read instead of every token
-    if (c == '\n') {
-      footprint.clear();
+  // The record's name is [name, name_end).
+  auto next_record = [&](const char *name, const char *name_end) {
+    if (n_records % reads_per_fragment == 0) {
+      end_fragment();
+      if (subsampling) {
+        fragment_hash = read_name_hash(name, name_end);
+        skipping = fragment_hash > sample_limit;
+      }
     }
-
-    // next token, please
+    ++n_records;
+    n_kept += !(skipping);
     token_length = 0;
+  };
+
+  // On error, return the negated offset of the offending line or record;  never 0, which would mean "no reads".
+  auto error_at = [&](const char *p) -> int64_t { return -max<int64_t>(1, p - window); };
+
+  if (format == FORMAT_BAM) {
+    // Sequences are decoded straight from their 4-bit BAM encoding to 2-bit codes.
+    for (uint64_t pos = 0; pos < bytes_in_chunk;) {
+      BamRecord rec;
+      if (!(rec.parse(window + pos, bytes_in_chunk - pos))) {
+        return error_at(window + pos);
+      }
+      pos += rec.size;
+      if (!(rec.primary())) {
+        continue;
+      }
+      next_record(rec.read_name, rec.read_name + max(1, int(rec.l_read_name)) - 1);
+      if (skipping) {
+        continue;
+      }
+      const uint8_t *seq = rec.seq;
+      for (int64_t i = 0; i < rec.l_seq; ++i) {
+        const uint8_t b_code = bam_base_codes[(seq[i / 2] >> ((~i & 1) * 4)) & 0xf];
+        if (b_code & 0xfc) {
+          token_length = 0; // N, or another ambiguity code
+        } else {
+          next_base(b_code);
+        }
+      }
+    }
+    end_fragment();
+    if (n_records % reads_per_fragment != 0) {
+      return -int64_t(bytes_in_chunk);
+    }
+    return n_kept;
   }
 
-  if (token_length != 0) {
-    // Truncated read sequence at end of chunk.  Malformed FASTQ.
-    return -bytes_in_chunk;
+  FastxParser parser(format);
+  const char *const chunk_end = window + bytes_in_chunk;
+
+  for (const char *line = window; line < chunk_end;) {
+    // The last line of the input need not end with a newline.
+    const char *eol = (const char *)memchr(line, '\n', chunk_end - line);
+    if (eol == NULL) {
+      eol = chunk_end;
+    }
+    const auto kind = parser.next_line(line, eol);
+    if (kind == FastxParser::MALFORMED) {
+      return error_at(line);
+    }
+    if (kind == FastxParser::HEADER) {
+      next_record(line + 1, eol);
+    } else if (kind == FastxParser::SEQUENCE && !(skipping)) {
+      // Tokens continue across line breaks within a sequence.
+      for (const char *p = line; p < eol; ++p) {
+        const uint8_t b_code = code_dict.data[(uint8_t)*p];
+        if (b_code & 0xfc) {
+          if (*p == 'N' || *p == 'n') {
+            token_length = 0;
+            continue;
+          }
+          return error_at(line);
+        }
+        next_base(b_code);
+      }
+    }
+    line = eol + 1;
   }
+  end_fragment();
 
-  return (n_lines + 3) / 4;
-}
+  if (format == FORMAT_FASTQ && !(parser.between_records())) {
+    // Truncated record at end of chunk.  Malformed FASTQ.
+    return -int64_t(bytes_in_chunk);
+  }
 
-const char *last_read(const char *window, const uint64_t bytes_in_window) {
-  // Return a pointer to the initial '@' character of the last read header
-  // within the given window.  Return NULL if no such read (for example,
-  // if the file does not conform to FASTQ format).
+  if (n_records % reads_per_fragment != 0) {
+    // A fragment is missing a mate.
+    return -int64_t(bytes_in_chunk);
+  }
 
-  // HOW?
-  //
-  // In FASTQ format, a line that starts with '@' is either a read header
-  // (also called sequence identifier), or a quality string.
-  //
-  // Examining only the local neighborhood of an arbitrary line L that
-  // starts with '@', we may quickly determine whether L contains a read header
-  // or a quality string by looking at the first character of line L - 2.
-  //
-  // If the first character of line L - 2 is '+', then line L is a read header.
-  // Otherwise, line L is a quality string and line L - 3 is a read header.
-  //
-  // This is not merely an heuristic.  It follows from the fastq format definition.
+  return n_kept;
+}
 
-  // First find where in the window the last few lines begin.
-  // Let line_start[3] point to the first character on the last line within the
-  // window, line_start[2] same for the previous line, etc.  If fewer than 4 lines
-  // (malformed fastq), let all remaining line_start's be NULL.
-  // Then compute L such that line_start[L] points to the '@' character of the
-  // last read header in the window.
+template <class Geometry>
+int64_t kmer_lookup_chunk_counted(vector<uint64_t> *kmer_matches, const LmerRange *const lmer_index,
+                                  const uint64_t *const mmer_bloom, const uint32_t *const kmers_index,
+                                  const uint64_t *const snps, const char *const window, const uint64_t bytes_in_chunk,
+                                  const Geometry &geometry, QueryCounters *counters, const int reads_per_fragment,
+                                  const InputFormat format, const uint64_t sample_limit, vector<uint64_t> *sampled) {
+  if (counters) {
+    return kmer_lookup_chunk_impl(kmer_matches, lmer_index, mmer_bloom, kmers_index, snps, window, bytes_in_chunk, geometry,
+                                  *counters, reads_per_fragment, format, sample_limit, sampled);
+  }
+  NoQueryCounters no_counters;
+  return kmer_lookup_chunk_impl(kmer_matches, lmer_index, mmer_bloom, kmers_index, snps, window, bytes_in_chunk, geometry,
+                                no_counters, reads_per_fragment, format, sample_limit, sampled);
+}
 
-  // no read is under 4 bytes in FASTQ;  checking early helps avoid corner cases below
-  if (bytes_in_window <= 4) {
-    return NULL;
+// Pass counters == NULL unless hot path counters were requested.  With reads_per_fragment == 2,
+// the chunk holds interleaved mates, and each SNP counts at most once per pair.  The chunk must
+// start at a record boundary;  the return value counts records, whether FASTQ reads or FASTA sequences.
+// Only fragments whose name hash is at most sample_limit are looked up and counted;  pass sampled
+// to collect their hashes and match counts, as described in kmer_lookup_chunk_impl.
+int64_t kmer_lookup_chunk(vector<uint64_t> *kmer_matches, const LmerRange *const lmer_index, const uint64_t *const mmer_bloom,
+                          const uint32_t *const kmers_index, const uint64_t *const snps, const char *const window,
+                          const uint64_t bytes_in_chunk, const int M2, const int M3, const string &in_path, const long s_start,
+                          QueryCounters *counters = NULL, const int reads_per_fragment = 1,
+                          const InputFormat format = FORMAT_FASTQ, const uint64_t sample_limit = UINT64_MAX,
+                          vector<uint64_t> *sampled = NULL) {
+  // Dispatch to a kernel specialized for the given geometry.  Keep these cases in sync with the
+  // table in choose_optimal_l_and_m.
+#define GTPRO_GEOMETRY_CASE(L2_, M3_)                                                                                         \
+  if (M2 == K2 - (L2_) && M3 == (M3_)) {                                                                                     \
+    return kmer_lookup_chunk_counted(kmer_matches, lmer_index, mmer_bloom, kmers_index, snps, window, bytes_in_chunk,        \
+                                     StaticGeometry<L2_, M3_>(), counters, reads_per_fragment, format, sample_limit,         \
+                                     sampled);                                                                               \
   }
+  GTPRO_GEOMETRY_CASE(32, 36)
+  GTPRO_GEOMETRY_CASE(31, 36)
+  GTPRO_GEOMETRY_CASE(30, 36)
+  GTPRO_GEOMETRY_CASE(30, 35)
+  GTPRO_GEOMETRY_CASE(29, 35)
+  GTPRO_GEOMETRY_CASE(29, 34)
+  GTPRO_GEOMETRY_CASE(29, 33)
+  GTPRO_GEOMETRY_CASE(28, 33)
+  GTPRO_GEOMETRY_CASE(28, 31)
+#undef GTPRO_GEOMETRY_CASE
+  return kmer_lookup_chunk_counted(kmer_matches, lmer_index, mmer_bloom, kmers_index, snps, window, bytes_in_chunk,
+                                   RuntimeGeometry(M2, M3), counters, reads_per_fragment, format, sample_limit, sampled);
+}
 
-  // Below we use "bytes_in_window - 1" not just "bytes_in_window" because we
-  // are interested in the character that comes after the newline.
-  const char *newline = find_last(window, window + bytes_in_window - 1, '\n');
-  int L = -1;
-  const char *line_start[4];
-  for (int l = 3; l >= 0; --l) {
-    if (newline == NULL) {
-      line_start[l] = NULL;
-      continue;
-    }
-    line_start[l] = newline + 1;
-    if (L == -1 && *(line_start[l]) == '@') {
-      L = l;
+// Finds where the last whole fragment (one read, or reads_per_fragment interleaved mates) ends in
+// a buffer that starts on a fragment boundary.  The buffer may grow between calls to scan, which
+// only looks at bytes it hasn't seen, so a record many segments long is scanned once.
+//
+// Multi-line FASTQ can't be split by looking backwards from the end of the buffer, since a
+// quality line may look just like a header, so the buffer is scanned forward, one line at a time.
+// In FASTA, a record is only known to be whole once the next header begins, so the last record
+// in the buffer is never counted as whole.
+struct RecordSplitter {
+  FastxParser parser;
+  const int reads_per_fragment;
+  int64_t n_records;
+  uint64_t line_start; // first line (or BAM record) not yet parsed
+  uint64_t searched;   // no newline in [line_start, searched)
+  uint64_t last_end;   // offset just past the last whole fragment, or 0 if none
+  bool malformed;
+  RecordSplitter(const InputFormat format, const int reads_per_fragment = 1)
+      : parser(format), reads_per_fragment(reads_per_fragment), n_records(0), line_start(0), searched(0), last_end(0),
+        malformed(format == FORMAT_UNKNOWN) {}
+  void scan(const char *buffer, const uint64_t size) {
+    if (parser.format == FORMAT_BAM) {
+      // Records are length prefixed;  only primary records count toward fragments.
+      while (!(malformed) && BamRecord::whole(buffer + line_start, size - line_start)) {
+        BamRecord rec;
+        if (!(rec.parse(buffer + line_start, size - line_start))) {
+          malformed = true;
+          break;
+        }
+        line_start += rec.size;
+        if (rec.primary() && ++n_records % reads_per_fragment == 0) {
+          last_end = line_start;
+        }
+      }
+      return;
     }
-    newline = find_last(window, newline, '\n');
-  }
-  if (L >= 2) {
-    if (line_start[L - 2] != NULL && *(line_start[L - 2]) != '+') {
-      L -= 3;
+    while (!(malformed) && searched < size) {
+      const char *line = buffer + line_start;
+      const char *eol = (const char *)memchr(buffer + searched, '\n', size - searched);
+      if (eol == NULL) {
+        // The last line is cut short.  A FASTA header is known by its first character, though,
+        // so a record boundary is never found later than the segment where it lies.
+        if (parser.format == FORMAT_FASTA && parser.state == FastxParser::IN_SEQUENCE && line_start < size &&
+            *line == '>' && n_records % reads_per_fragment == 0) {
+          last_end = line_start;
+        }
+        searched = size;
+        break;
+      }
+      const auto kind = parser.next_line(line, eol);
+      if (kind == FastxParser::MALFORMED) {
+        malformed = true;
+        break;
+      }
+      if (parser.format == FORMAT_FASTA && kind == FastxParser::HEADER) {
+        if (n_records > 0 && n_records % reads_per_fragment == 0) {
+          last_end = line_start;
+        }
+        ++n_records;
+      }
+      line_start = searched = eol + 1 - buffer;
+      if (parser.format == FORMAT_FASTQ && kind == FastxParser::QUALITY && parser.between_records()) {
+        ++n_records;
+        if (n_records % reads_per_fragment == 0) {
+          last_end = line_start;
+        }
+      }
     }
   }
-  if (L >= 0 && line_start[L] != NULL && *(line_start[L]) == '@') {
-    return line_start[L];
-  }
-  return NULL;
+};
+
+// Return a pointer just past the last whole fragment within the given window, which must start
+// on a fragment boundary.  Return NULL if the window holds no whole fragment, either because the
+// input does not conform to the format, or because the first record does not fit in the window.
+const char *last_record(const char *window, const uint64_t bytes_in_window, const InputFormat format,
+                        const int reads_per_fragment = 1) {
+  RecordSplitter splitter(format, reads_per_fragment);
+  splitter.scan(window, bytes_in_window);
+  return splitter.last_end ? window + splitter.last_end : NULL;
 }
 
 struct ReadersContext {
@@ -644,7 +1090,8 @@ struct ReadersContext {
   int readers;
   mutex mtx;
   condition_variable cv;
-  ReadersContext() : readers(0), MAX_PARALLEL_READERS(max(2, min(12, int(thread::hardware_concurrency()) / 6))) {};
+  static int default_readers() { return max(2, min(12, int(thread::hardware_concurrency()) / 6)); }
+  ReadersContext(const int max_readers = default_readers()) : readers(0), MAX_PARALLEL_READERS(max_readers) {};
   void acquire_reader() {
     unique_lock<mutex> lk(mtx);
     bool acquired = false;
@@ -682,6 +1129,178 @@ struct ReadersContextRelease {
   ~ReadersContextRelease() { ctx.release_reader(); }
 };
 
+// Hardware event counters for the calling thread, for --perf-counters.  This is Linux only;
+// elsewhere, or where perf_event_open is not permitted (see /proc/sys/kernel/perf_event_paranoid),
+// the group is unavailable and every reading is zero.  Events are counted in user space only.
+enum HardwareEvent { HW_CYCLES, HW_INSTRUCTIONS, HW_LLC_MISSES, HW_DTLB_MISSES, N_HW_EVENTS };
+const char *hw_event_names[N_HW_EVENTS] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+
+struct PerfEventGroup {
+  int fds[N_HW_EVENTS];
+  int slot[N_HW_EVENTS]; // position of each event in the group read, or -1 if it failed to open
+  int n_open;
+  PerfEventGroup(const bool open_events = true) : n_open(0) {
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      fds[e] = -1;
+      slot[e] = -1;
+    }
+#if __linux__
+    if (!(open_events)) {
+      return;
+    }
+    const auto cache_miss = [](const uint64_t cache) {
+      return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    };
+    const uint64_t events[N_HW_EVENTS][2] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL)},
+        {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB)},
+    };
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = events[e][0];
+      attr.config = events[e][1];
+      attr.disabled = (n_open == 0); // the group leader starts disabled, members follow the leader
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      const int group_fd = n_open ? leader_fd() : -1;
+      fds[e] = syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+      if (fds[e] != -1) {
+        slot[e] = n_open++;
+      }
+    }
+    errno = 0; // unsupported events are expected, not errors
+#endif
+  }
+  ~PerfEventGroup() {
+    for (auto fd : fds) {
+      if (fd != -1) {
+        close(fd);
+      }
+    }
+    errno = 0;
+  }
+  bool available() const { return n_open > 0; }
+  int leader_fd() const {
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      if (slot[e] == 0) {
+        return fds[e];
+      }
+    }
+    return -1;
+  }
+  void start() {
+#if __linux__
+    if (available()) {
+      ioctl(leader_fd(), PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(leader_fd(), PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+  // Stop counting and store the readings, scaled up if the kernel had to multiplex the group.
+  void stop(uint64_t *readings) {
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      readings[e] = 0;
+    }
+#if __linux__
+    if (!(available())) {
+      return;
+    }
+    ioctl(leader_fd(), PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t buf[3 + N_HW_EVENTS]; // nr, time_enabled, time_running, values...
+    const auto bytes = read(leader_fd(), buf, sizeof(buf));
+    if (bytes >= (ssize_t)(3 * sizeof(uint64_t)) && buf[0] == uint64_t(n_open) && buf[2] > 0) {
+      const double scale = double(buf[1]) / buf[2];
+      for (int e = 0; e < N_HW_EVENTS; ++e) {
+        if (slot[e] != -1) {
+          readings[e] = uint64_t(buf[3 + slot[e]] * scale);
+        }
+      }
+    }
+    errno = 0;
+#endif
+  }
+};
+
+// Run-wide totals for --counters.  Query tasks and readers each accumulate locally and add
+// their totals here once per segment, so the atomics are never contended on the hot path.
+struct PerfCounters {
+  atomic<uint64_t> kmers;
+  atomic<uint64_t> bloom_passes;
+  atomic<uint64_t> lmer_probes;
+  atomic<uint64_t> bucket_entries;
+  atomic<uint64_t> matches;
+  atomic<uint64_t> snp_hits;
+  atomic<uint64_t> segments;
+  atomic<uint64_t> bytes_read;
+  atomic<uint64_t> read_us;
+  atomic<uint64_t> segment_wait_us;
+  atomic<uint64_t> queue_wait_us;
+  atomic<uint64_t> query_us;
+  atomic<uint64_t> output_us;
+  // Hardware events per pipeline stage, under --perf-counters.  Kernel stages get signed
+  // differences between passes that stop at successive stages, so they are approximate:  earlier
+  // passes warm the caches for later ones, and a stage may come out negative.  They do add up to
+  // hw_query_events, which is measured on the complete pass alone.
+  bool hw_requested;
+  bool hw_enabled;
+  bool hw_event_available[N_HW_EVENTS];
+  atomic<int64_t> hw_events[N_STAGES][N_HW_EVENTS];
+  atomic<uint64_t> hw_query_events[N_HW_EVENTS];
+  PerfCounters()
+      : kmers(0), bloom_passes(0), lmer_probes(0), bucket_entries(0), matches(0), snp_hits(0), segments(0), bytes_read(0),
+        read_us(0), segment_wait_us(0), queue_wait_us(0), query_us(0), output_us(0), hw_requested(false), hw_enabled(false) {
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      hw_event_available[e] = false;
+      hw_query_events[e] = 0;
+      for (int stage = 0; stage < N_STAGES; ++stage) {
+        hw_events[stage][e] = 0;
+      }
+    }
+  }
+  // Probe once whether this process may count hardware events.
+  void enable_hw_events() {
+    hw_requested = true;
+    PerfEventGroup probe;
+    hw_enabled = probe.available();
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      hw_event_available[e] = (probe.slot[e] != -1);
+    }
+  }
+  // Readings are cumulative over successively longer kernel passes;  the stage gets the difference.
+  void add_stage_events(const int stage, const uint64_t *cumulative, const uint64_t *previous = NULL) {
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      hw_events[stage][e] += int64_t(cumulative[e]) - int64_t(previous ? previous[e] : 0);
+    }
+  }
+  // Readings of the complete kernel pass.
+  void add_query_events(const uint64_t *readings) {
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      hw_query_events[e] += readings[e];
+    }
+  }
+  void add_query(const QueryCounters &qc, const uint64_t hits, const long queue_wait, const long query_time) {
+    kmers += qc.kmers;
+    bloom_passes += qc.bloom_passes;
+    lmer_probes += qc.lmer_probes;
+    bucket_entries += qc.bucket_entries;
+    matches += qc.matches;
+    snp_hits += hits;
+    ++segments;
+    queue_wait_us += queue_wait;
+    query_us += query_time;
+  }
+  void add_read(const uint64_t bytes, const long segment_wait, const long read_time) {
+    bytes_read += bytes;
+    segment_wait_us += segment_wait;
+    read_us += read_time;
+  }
+};
+
 struct SegmentContext {
   // There are two references to each buffer segment (two tokens).  When a segment is
   // acquired, both tokens are held by scan_input.  After run_queries is enqueued for
@@ -696,7 +1315,14 @@ struct SegmentContext {
   vector<char> buffer;
   int n_segments;
   char *buffer_addr;
-  SegmentContext(const int n_threads) : n_segments(max(n_threads + 1, int(n_threads *READ_AHEAD_RATIO))) {
+  PerfCounters *counters;
+  // Each reader holds on to its last segment while it waits for the next one, so there must be
+  // at least one segment more than there are readers, or all readers could wait forever.
+  static int segments_for(const int n_threads, const int n_readers) {
+    return max(max(n_threads, n_readers) + 1, int(n_threads * READ_AHEAD_RATIO));
+  }
+  SegmentContext(const int n_threads, const int n_readers, PerfCounters *counters = NULL)
+      : n_segments(segments_for(n_threads, n_readers)), counters(counters) {
     tokens.resize(n_segments);
     buffer.resize(SEGMENT_SIZE * n_segments);
     buffer_addr = buffer.data();
@@ -768,104 +1394,1199 @@ struct Segment {
     ctx.release_segment(idx, tokens);
     reset();
   };
-  void advance(FILE *input_file, const int channel) {
+  // Returns the number of bytes read from input_file.
+  uint64_t advance(FILE *input_file, const int channel) {
+    return advance_with([&](char *dst, const uint64_t capacity) { return fread(dst, 1, capacity, input_file); });
+  };
+  // Same, but read(dst, capacity) fills the segment, and returns the number of bytes it read.
+  template <class Read> uint64_t advance_with(Read read) {
     assert_invariant();
     Segment old(*this);
     // cerr << "Waiting to acquire segment for channel " << channel << endl;
+    const auto t_wait = ctx.counters ? steady_time_us() : 0;
     idx = ctx.acquire_segment(&tokens);
+    const auto t_read = ctx.counters ? steady_time_us() : 0;
     // cerr << "Acquired segment " << idx << " for channel " << channel << endl;
     assert(idx != old.idx);
     start_addr = ctx.buffer_addr + idx * SEGMENT_SIZE;
     if (old.bytes_leftover) {
       memmove(start_addr, old.end_addr, old.bytes_leftover);
     }
-    const auto bytes_read = fread(start_addr + old.bytes_leftover, 1, SEGMENT_SIZE - old.bytes_leftover, input_file);
+    const uint64_t bytes_read = read(start_addr + old.bytes_leftover, SEGMENT_SIZE - old.bytes_leftover);
+    if (ctx.counters) {
+      ctx.counters->add_read(bytes_read, t_read - t_wait, steady_time_us() - t_read);
+    }
     size = bytes_read + old.bytes_leftover;
     end_addr = start_addr + size;
     bytes_leftover = 0;
     assert_invariant();
+    return bytes_read;
   };
 };
 
-struct Result {
-  int channel;
-  const string in_path;
-  string o_name;
-  int n_input_chunks, n_processed_chunks;
-  bool finished_reading;
-  bool done_with_output;
-  vector<uint64_t> *p_kmer_matches;
-  uint64_t chars_read;
-  bool error;
-  bool io_error;
-  bool output_error;
-  bool missing_decompressor;
-  uint64_t error_pos;
-  uint64_t n_reads;
-  FILE *input_file;
-  bool popened;
-  int decomp_idx;
-  string out_path;
-  string err_path;
-  bool skip;
-  mutex *p_print_lock;
-  string full_inpath;
-  Result(int channel, const char *in_path, const char *oooname, const string &dbbase, const bool force, mutex *p_print_lock,
-         const string &c_prefix)
-      : channel(channel), in_path(in_path), n_input_chunks(0), n_processed_chunks(0), finished_reading(false),
-        done_with_output(false), o_name(oooname == NULL ? "" : oooname), p_kmer_matches(new vector<uint64_t>()), chars_read(0),
-        error(false), output_error(false), missing_decompressor(false), error_pos(1ULL << 48), io_error(false), n_reads(0),
-        input_file(NULL), popened(false), skip(false), p_print_lock(p_print_lock) {
-    decomp_idx = decompressor(in_path);
-    const char *compext = "";
-    if (decomp_idx != -1) {
-      // compress output with same compressor as input
-      compext = compressors[decomp_idx][0];
+// Read into dst until it is full, the input ends, or max_wait_ms pass after the first bytes arrive,
+// so that a slow stream is handed on as it comes instead of once a whole segment is buffered.
+// Returns the number of bytes read, which is 0 only at the end of input or on error.
+uint64_t read_available(FILE *input_file, char *dst, const uint64_t capacity, const int max_wait_ms, bool &failed) {
+  const int fd = fileno(input_file);
+  uint64_t total = 0;
+  long deadline_us = 0;
+  while (total < capacity) {
+    if (total > 0) {
+      const int wait_ms = int((deadline_us - steady_time_us()) / 1000);
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) {
+        errno = 0; // a timeout, or EINTR;  hand on what we have
+        break;
+      }
     }
-    if (o_name.empty()) {
-      out_path = "/dev/stdout";
-      err_path = "/dev/stderr";
+    const auto n = read(fd, dst + total, capacity - total);
+    if (n < 0 && errno == EINTR) {
+      errno = 0;
+      continue;
     }
-    if (c_prefix.empty()) {
-      full_inpath = in_path;
-    } else if (in_path[0] == '/') {
-      cerr << chrono_time() << ": [WARNING] Ignoring specified -C prefix for non-relative input path: " << in_path << endl;
-      full_inpath = in_path;
-    } else {
-      full_inpath = c_prefix + "/" + in_path;
+    if (n <= 0) {
+      failed = (n < 0);
+      break;
     }
-    // Create a unique tag 'inbase' from the input path, to include in the
-    // output prefix where indicated by %{in}.  For instance, if the input
-    // path is /foo/bar123/r1.fastq.lz4, then inbase would be foo_bar123_r1.
-    // The -C prefix, if any, is intentionally not included.
-    const bool special = (0 == strncmp(out_path.c_str(), "/dev/", 5));
-    if (!(special)) {
-      // First, chop off compressor and format extensions.
-      string inbase = chopext(in_path, decomp_idx);
-      // Chop off all initial '.' and '/' characters.  Those would otherwise
-      // turn into leading underscores later.  Could use regex_replace,
-      // but this also works.
-      int nsi = 0;
-      while (nsi < inbase.size() && (inbase[nsi] == '/' || inbase[nsi] == '.')) {
-        ++nsi;
+    if (total == 0) {
+      deadline_us = steady_time_us() + max_wait_ms * 1000L;
+    }
+    total += n;
+  }
+  return total;
+}
+
+// Reads the R1 and R2 files of a sample in lock-step for --paired, and interleaves whole records
+// of mates, so that every segment holds whole fragments.
+struct MateReader {
+  constexpr static uint64_t STAGE_SIZE = SEGMENT_SIZE / 4;
+  FILE *files[2];
+  vector<char> stage[2];
+  uint64_t begin[2];
+  uint64_t end[2];
+  bool eof[2];
+  // Both files must be in the same format, detected from the first record of R1.
+  InputFormat format;
+  // One file ran out of records before the other, a record did not fit STAGE_SIZE, or the files
+  // are not in the same known format.
+  bool error;
+  MateReader(FILE *r1, FILE *r2) : format(FORMAT_UNKNOWN), error(false) {
+    files[0] = r1;
+    files[1] = r2;
+    for (int side = 0; side < 2; ++side) {
+      stage[side].resize(STAGE_SIZE);
+      begin[side] = end[side] = 0;
+      eof[side] = false;
+    }
+  }
+  // Offset just past the staged record at begin[side], or 0 if it is not wholly staged.
+  uint64_t record_end(const int side) {
+    const char *const data = stage[side].data();
+    const char *const limit = data + end[side];
+    if (format == FORMAT_UNKNOWN) {
+      return 0;
+    }
+    FastxParser parser(format);
+    bool in_record = false;
+    for (const char *line = data + begin[side]; line < limit;) {
+      const char *eol = (const char *)memchr(line, '\n', limit - line);
+      if (eol == NULL) {
+        return 0;
       }
-      if (nsi) {
-        inbase = inbase.substr(nsi, inbase.size() - nsi);
+      const auto kind = parser.next_line(line, eol);
+      if (kind == FastxParser::MALFORMED) {
+        return 0;
       }
-      // Replace all '/' and '.' with '_'
-      inbase = regex_replace(inbase, regex("\\."), "_");
-      inbase = regex_replace(inbase, regex("/"), "_");
-      // Replace %{in} with inbase in output prefix.
-      o_name = regex_replace(o_name, regex("%\\{in\\}"), inbase);
+      if (kind == FastxParser::HEADER) {
+        if (in_record) {
+          return line - data; // the next FASTA record begins
+        }
+        in_record = true;
+      }
+      line = eol + 1;
+      if (format == FORMAT_FASTQ && kind == FastxParser::QUALITY && parser.between_records()) {
+        return line - data;
+      }
+    }
+    // At the end of the file, the last FASTA record is whole.
+    return (format == FORMAT_FASTA && in_record && eof[side]) ? end[side] : 0;
+  }
+  // Returns false when no more bytes could be staged.
+  bool refill(const int side) {
+    auto &buf = stage[side];
+    if (eof[side]) {
+      return false;
+    }
+    memmove(buf.data(), buf.data() + begin[side], end[side] - begin[side]);
+    end[side] -= begin[side];
+    begin[side] = 0;
+    if (end[side] == STAGE_SIZE) {
+      return false; // the record is too long
+    }
+    const auto bytes_read = fread(buf.data() + end[side], 1, STAGE_SIZE - end[side], files[side]);
+    end[side] += bytes_read;
+    if (bytes_read == 0) {
+      eof[side] = true;
+      if (end[side] && end[side] < STAGE_SIZE && buf[end[side] - 1] != '\n') {
+        // The last line of a file need not end in a newline.
+        buf[end[side]++] = '\n';
+      }
+      return true; // a record may end at the end of the file
+    }
+    if (format == FORMAT_UNKNOWN && side == 0) {
+      format = detect_format(buf.data(), end[side]);
+    }
+    return true;
+  }
+  // Copy whole pairs of mate records to dst, up to capacity bytes.  Returns the bytes copied.
+  uint64_t read_pairs(char *dst, const uint64_t capacity) {
+    uint64_t copied = 0;
+    while (true) {
+      uint64_t record_ends[2];
+      for (int side = 0; side < 2; ++side) {
+        while ((record_ends[side] = record_end(side)) == 0 && refill(side)) {
+        }
+      }
+      if (record_ends[0] == 0 || record_ends[1] == 0) {
+        error = (begin[0] != end[0]) || (begin[1] != end[1]);
+        break;
+      }
+      if (detect_format(stage[1].data() + begin[1], end[1] - begin[1]) != format) {
+        error = true;
+        break;
+      }
+      const auto len_0 = record_ends[0] - begin[0];
+      const auto len_1 = record_ends[1] - begin[1];
+      if (copied + len_0 + len_1 > capacity) {
+        break;
+      }
+      memcpy(dst + copied, stage[0].data() + begin[0], len_0);
+      memcpy(dst + copied + len_0, stage[1].data() + begin[1], len_1);
+      copied += len_0 + len_1;
+      begin[0] = record_ends[0];
+      begin[1] = record_ends[1];
+    }
+    return copied;
+  }
+};
+
+// Under --spill-dir without --max-ram or --match-buffer-mb, the matches an input buffers before
+// spilling a run.
+constexpr uint64_t SPILL_BUFFER_BYTES = 1ULL << 30;
+
+// How a --max-ram budget is divided among the parts of a run;  see plan_memory.
+struct MemoryPlan {
+  double budget_gb;
+  int l;
+  int m;
+  int n_threads;
+  int n_readers;
+  // Matches buffered per input before they are folded into dense counters;  --match-buffer-mb
+  // may set it without a budget.
+  uint64_t match_buffer_bytes;
+  MemoryPlan() : budget_gb(0.0), l(0), m(0), n_threads(0), n_readers(0), match_buffer_bytes(0) {}
+};
+
+// When to write count snapshots while streaming from stdin;  see --snapshot-reads.
+struct SnapshotPlan {
+  uint64_t every_reads; // 0 for none by read count
+  double every_secs;    // 0 for none by time
+  bool delta;           // counts since the previous snapshot, instead of since the start
+  SnapshotPlan() : every_reads(0), every_secs(0.0), delta(false) {}
+  bool enabled() const { return every_reads > 0 || every_secs > 0; }
+  // Queue partial segments after this long, so a slow stream still reaches the query threads.
+  int max_latency_ms() const { return every_secs > 0 ? max(10, min(1000, int(every_secs * 500))) : 1000; }
+};
+
+// When to stop reading an input whose genotypes have saturated;  see --stop-coverage.
+struct StopPlan {
+  // The new SNP rate is measured over successive blocks of this many reads.
+  constexpr static uint64_t BLOCK_READS = 1000000;
+  double coverage;              // 0 for no target;  else mean hits per SNP found, in every species found
+  double new_snps_per_million;  // 0 for no target;  else stop when a block finds fewer new SNPs per million reads
+  StopPlan() : coverage(0.0), new_snps_per_million(0.0) {}
+  bool enabled() const { return coverage > 0 || new_snps_per_million > 0; }
+};
+
+// Which reads to count;  see --subsample.
+struct Subsample {
+  double fraction; // 0 for none;  else keep about this fraction of fragments
+  uint64_t count;  // 0 for none;  else keep the fragments with the count smallest name hashes
+  Subsample() : fraction(0.0), count(0) {}
+  bool enabled() const { return fraction > 0 || count > 0; }
+  // Fragments with a name hash above this are skipped.
+  uint64_t initial_limit() const { return fraction > 0 ? uint64_t(fraction * 18446744073709551615.0) : UINT64_MAX; }
+};
+
+// The real SNP ids of the DB in increasing order, built on first use.  Inputs whose matches
+// outgrow their buffer under --max-ram switch to one counter per SNP, indexed by rank in this
+// list, so their memory stops growing with the number of reads.
+struct DenseSnpIndex {
+  const uint64_t *snps;
+  const uint64_t snps_count;
+  vector<uint64_t> real_ids;
+  once_flag built;
+  // For --stop-coverage:  the species of each rank, numbered 0, 1, 2, ... in order of species id.
+  vector<uint32_t> species_of_rank;
+  uint32_t n_species;
+  once_flag species_built;
+  DenseSnpIndex(const uint64_t *snps, const uint64_t snps_count) : snps(snps), snps_count(snps_count), n_species(0) {}
+  // Upper bound on the memory this index and one input's counters take, for planning.
+  static uint64_t shared_bytes(const uint64_t snps_count) { return snps_count * (sizeof(uint64_t) + sizeof(uint32_t)); }
+  static uint64_t counters_bytes(const uint64_t snps_count) { return snps_count * sizeof(uint32_t); }
+  const vector<uint64_t> &ids() {
+    call_once(built, [&] {
+      real_ids.reserve(snps_count);
+      for (uint64_t i = 0; i < snps_count; ++i) {
+        real_ids.push_back(snps[3 * i + 2] & SNP_MAX_REAL_ID);
+      }
+      sort(real_ids.begin(), real_ids.end());
+      real_ids.erase(unique(real_ids.begin(), real_ids.end()), real_ids.end());
+      real_ids.shrink_to_fit();
+    });
+    return real_ids;
+  }
+  const vector<uint32_t> &species() {
+    call_once(species_built, [&] {
+      const auto &sorted = ids();
+      // Positions differ in their number of digits, so ids do not sort by species.
+      vector<uint64_t> species_ids;
+      for (const auto snp : sorted) {
+        species_ids.push_back(snp_species(snp));
+      }
+      sort(species_ids.begin(), species_ids.end());
+      species_ids.erase(unique(species_ids.begin(), species_ids.end()), species_ids.end());
+      n_species = species_ids.size();
+      species_of_rank.reserve(sorted.size());
+      for (const auto snp : sorted) {
+        species_of_rank.push_back(lower_bound(species_ids.begin(), species_ids.end(), snp_species(snp)) - species_ids.begin());
+      }
+    });
+    return species_of_rank;
+  }
+  // Replace each real SNP id in matches with its rank.
+  void rank(vector<uint64_t> &matches) {
+    const auto &sorted = ids();
+    for (auto &snp : matches) {
+      const auto it = lower_bound(sorted.begin(), sorted.end(), snp);
+      assert(it != sorted.end() && *it == snp);
+      snp = it - sorted.begin();
+    }
+  }
+};
+
+// Output formats;  see --out-format.
+//
+// OUT_TSV has one line per SNP with hits:  the SNP id and its count, separated by a tab, in
+// increasing order of SNP id.  OUT_BINARY holds the same rows in the same order:  the 8 byte
+// magic "GTPROBIN";  then for each row the LEB128 varint difference between its SNP id
+// and the previous row's (the first row's from 0), followed by the varint count;  then a 32 byte
+// trailer of the number of rows, hits and reads as little endian uint64 and the magic "GTPROEND".
+// The trailer lets a writer stream to a pipe, and a reader check a memory mapped file whole.
+// OUT_ANNOTATED, chosen by --dict, pairs up the alleles of each SNP site and writes the lines
+// of gt_pro parse instead:  the site's fields from the SNP dictionary and the count of each allele.
+enum OutputFormat { OUT_TSV, OUT_BINARY, OUT_ANNOTATED };
+constexpr char BINARY_MAGIC[] = "GTPROBIN";
+constexpr char BINARY_END_MAGIC[] = "GTPROEND";
+constexpr uint64_t BINARY_TRAILER_BYTES = 32;
+
+void put_varint(FILE *f, uint64_t value) {
+  uint8_t bytes[10];
+  int n = 0;
+  do {
+    bytes[n++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+    value >>= 7;
+  } while (value);
+  fwrite(bytes, 1, n, f);
+}
+
+// Output is formatted into chunks this large, each written with one call, rather than row by row.
+constexpr uint64_t OUTPUT_CHUNK_BYTES = 1 << 20;
+
+void append_varint(string &chunk, uint64_t value) {
+  do {
+    chunk += char((value & 0x7f) | (value >= 0x80 ? 0x80 : 0));
+    value >>= 7;
+  } while (value);
+}
+
+void append_decimal(string &chunk, uint64_t value) {
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (n) {
+    chunk += digits[--n];
+  }
+}
+
+void put_le64(FILE *f, uint64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; ++i) {
+    bytes[i] = uint8_t(value >> (8 * i));
+  }
+  fwrite(bytes, 1, 8, f);
+}
+
+uint64_t le64(const uint8_t *p) { return uint64_t(le32(p)) | (uint64_t(le32(p + 4)) << 32); }
+
+// Reads the rows of an OUT_BINARY file, memory mapped, in order.
+struct BinaryCountsReader {
+  const uint8_t *data; // non-NULL when mapped by open
+  uint64_t size;
+  const uint8_t *pos;
+  const uint8_t *end; // start of the trailer
+  uint64_t rows, hits, reads;
+  uint64_t snp;
+  int fd;
+  BinaryCountsReader() : data(NULL), size(0), pos(NULL), end(NULL), rows(0), hits(0), reads(0), snp(0), fd(-1) {}
+  ~BinaryCountsReader() { close(); }
+  // Returns false if path is not a whole OUT_BINARY file.
+  bool open(const string &path) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || uint64_t(st.st_size) < 8 + BINARY_TRAILER_BYTES) {
+      close();
+      return false;
+    }
+    size = st.st_size;
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      close();
+      return false;
+    }
+    data = (const uint8_t *)mapped;
+    if (!(read_image(data, size))) {
+      close();
+      return false;
+    }
+    return true;
+  }
+  // Same as open, for an OUT_BINARY image in memory that stays valid while it is read, such as a
+  // column of a --cohort matrix.
+  bool read_image(const uint8_t *image, const uint64_t image_size) {
+    if (image_size < 8 + BINARY_TRAILER_BYTES) {
+      return false;
+    }
+    end = image + image_size - BINARY_TRAILER_BYTES;
+    if (memcmp(image, BINARY_MAGIC, 8) || memcmp(end + 24, BINARY_END_MAGIC, 8)) {
+      return false;
+    }
+    rows = le64(end);
+    hits = le64(end + 8);
+    reads = le64(end + 16);
+    pos = image + 8;
+    snp = 0;
+    return true;
+  }
+  void close() {
+    if (data) {
+      munmap((void *)data, size);
+      data = NULL;
+    }
+    if (fd != -1) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+  // Returns false at the end of the rows, or if they are malformed;  see malformed().
+  bool next(uint64_t &snp_id, uint64_t &count) {
+    uint64_t delta;
+    if (pos == end || !(get_varint(delta)) || !(get_varint(count))) {
+      return false;
+    }
+    snp += delta;
+    snp_id = snp;
+    return true;
+  }
+  bool malformed() const { return pos != end; }
+
+private:
+  bool get_varint(uint64_t &value) {
+    value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+      const uint8_t b = *pos++;
+      value |= uint64_t(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        return true;
+      }
+    }
+    pos = NULL; // truncated, or too long
+    return false;
+  }
+};
+
+// Reads the rows of a gt_pro output file of either --out-format, compressed or not, in order.
+struct OutputReader {
+  BinaryCountsReader binary;
+  bool is_binary;
+  FILE *file;
+  bool popened;
+  char *line;
+  size_t line_cap;
+  uint64_t rows;
+  bool bad;
+  OutputReader() : is_binary(false), file(NULL), popened(false), line(NULL), line_cap(0), rows(0), bad(false) {}
+  ~OutputReader() {
+    close();
+    free(line);
+  }
+  // Returns false if path cannot be opened.
+  bool open(const string &path) {
+    const auto ext = strlen(".gtpb");
+    is_binary = path.size() > ext && 0 == path.compare(path.size() - ext, ext, ".gtpb");
+    if (is_binary) {
+      return binary.open(path);
+    }
+    const auto decomp_idx = decompressor(path.c_str());
+    popened = decomp_idx != -1;
+    errno = 0;
+    if (!(popened)) {
+      file = fopen(path.c_str(), "r");
+    } else if (0 == strcmp(compressors[decomp_idx][2], "tested_and_works")) {
+      file = popen_decompressor(compressors[decomp_idx][1], path.c_str());
+    }
+    errno = 0;
+    return file != NULL;
+  }
+  // Returns false at the end of the rows, or if they are malformed;  see failed().
+  bool next(uint64_t &snp_id, uint64_t &count) {
+    if (is_binary) {
+      return binary.next(snp_id, count) && ++rows;
+    }
+    while (file && getline(&line, &line_cap, file) != -1) {
+      if (line[0] == '#' || 0 == strncmp(line, "snp_id", 6)) {
+        continue;
+      }
+      char *end;
+      snp_id = strtoull(line, &end, 10);
+      bad = end == line || (*end != '\t' && *end != ' ');
+      count = bad ? 0 : strtoull(end, &end, 10);
+      if (bad || (*end != '\n' && *end != '\0')) {
+        bad = true;
+        return false;
+      }
+      ++rows;
+      return true;
+    }
+    return false;
+  }
+  bool failed() {
+    if (is_binary) {
+      return binary.malformed() || rows != binary.rows;
+    }
+    return bad || file == NULL || ferror(file);
+  }
+  // Returns false if a decompressor exited with an error.
+  bool close() {
+    auto ok = true;
+    if (file) {
+      ok = popened ? pclose(file) == 0 : fclose(file) == 0;
+      file = NULL;
+    }
+    binary.close();
+    errno = 0;
+    return ok;
+  }
+};
+
+// A SNP id in gt_pro output is the decimal digits of the species id (6), the allele (1)
+// and the genomic position (the rest), in that order, as scripts/gtp_parse.py splits it.
+// Returns false if snp_id has too few digits.
+bool split_snp_id(const uint64_t snp_id, uint64_t &species, uint64_t &allele, uint64_t &position) {
+  uint64_t scale = 1;
+  auto digits = 1;
+  for (auto n = snp_id; n >= 10; n /= 10) {
+    scale *= 10;
+    ++digits;
+  }
+  if (digits < 8) {
+    return false;
+  }
+  // scale is 10^(digits - 1);  the position has digits - 7 of them.
+  const auto position_scale = scale / 1000000;
+  position = snp_id % position_scale;
+  allele = (snp_id / position_scale) % 10;
+  species = snp_id / position_scale / 10;
+  return true;
+}
+
+// Maps the whole file at path read only, without populating it up front.  Returns NULL on failure.
+const char *map_file(const char *path, uint64_t &size) {
+  size = get_fsize(path);
+  const auto fd = open(path, O_RDONLY);
+  if (fd == -1 || size == 0) {
+    if (fd != -1) {
+      close(fd);
+    }
+    errno = 0;
+    return NULL;
+  }
+  const auto data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  errno = 0;
+  return data == MAP_FAILED ? NULL : (const char *)data;
+}
+
+// Appends the whitespace separated fields of the line [p, eol) to joined, separated by tabs,
+// as "\t".join(line.split()) would in scripts/gtp_parse.py.
+void join_fields(const char *p, const char *eol, string &joined) {
+  while (p < eol) {
+    while (p < eol && isspace(*p)) {
+      ++p;
+    }
+    auto q = p;
+    while (q < eol && !(isspace(*q))) {
+      ++q;
+    }
+    if (q > p) {
+      if (!(joined.empty())) {
+        joined += '\t';
+      }
+      joined.append(p, q - p);
+    }
+    p = q;
+  }
+}
+
+// A SNP site, i.e. both alleles, as one sortable key.  Species ids have 6 digits and positions
+// at most 9 (see get_species in sckmerdb_build), so neither overflows its bits.
+constexpr auto SITE_POSITION_BITS = 40;
+uint64_t site_key(const uint64_t species, const uint64_t position) {
+  return (species << SITE_POSITION_BITS) | position;
+}
+
+// Whether the line [p, eol) holds nothing but whitespace.
+bool is_blank(const char *p, const char *eol) {
+  return find_if(p, eol, [](const char c) { return !(isspace(c)); }) == eol;
+}
+
+// Parses the species and position that start the SNP dictionary line [p, eol), which may be the
+// last bytes of a mapped file, so nothing past eol is read.  Returns false unless both are there,
+// as whitespace separated decimal numbers.
+bool parse_site(const char *p, const char *eol, uint64_t &species, uint64_t &position) {
+  uint64_t *fields[2] = {&species, &position};
+  for (auto field : fields) {
+    while (p < eol && isspace(*p)) {
+      ++p;
+    }
+    const auto digits = p;
+    *field = 0;
+    // At most 19 digits, which cannot overflow;  a longer number fails below.
+    while (p < eol && isdigit(*p) && p - digits < 19) {
+      *field = *field * 10 + (*p - '0');
+      ++p;
+    }
+    if (p == digits || (p < eol && !(isspace(*p)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Binary SNP dictionary;  see gt_pro dict.
+//
+// The 8 byte magic "GTPRODCT";  then the number of records and the size of the heap as uint64;
+// then the heap, holding the fields of each line of snp_dict.tsv joined by tabs, back to back in
+// record order and padded to 8 bytes;  then one DictRecord per line, in order of site key.
+// The annotation of record i ends where that of record i + 1 begins.
+constexpr char DICT_MAGIC[] = "GTPRODCT";
+constexpr uint64_t DICT_HEADER_BYTES = 24;
+
+struct DictRecord {
+  uint64_t key;
+  uint64_t offset; // into the heap
+};
+
+struct BinaryDict {
+  const char *data;
+  uint64_t size;
+  const char *heap;
+  uint64_t heap_bytes;
+  const DictRecord *records;
+  uint64_t n_records;
+  bool has_magic;
+  BinaryDict() : data(NULL), size(0), heap(NULL), heap_bytes(0), records(NULL), n_records(0), has_magic(false) {}
+  ~BinaryDict() { close(); }
+  // Returns false if path is not a whole binary dictionary;  has_magic tells if it claims to be one.
+  bool open(const char *path) {
+    data = map_file(path, size);
+    has_magic = data != NULL && size >= 8 && 0 == memcmp(data, DICT_MAGIC, 8);
+    if (!(has_magic) || size < DICT_HEADER_BYTES) {
+      close();
+      return false;
+    }
+    n_records = ((const uint64_t *)data)[1];
+    heap_bytes = ((const uint64_t *)data)[2];
+    if (heap_bytes % 8 || heap_bytes > size - DICT_HEADER_BYTES ||
+        n_records != (size - DICT_HEADER_BYTES - heap_bytes) / sizeof(DictRecord) ||
+        (size - DICT_HEADER_BYTES - heap_bytes) % sizeof(DictRecord)) {
+      close();
+      return false;
+    }
+    heap = data + DICT_HEADER_BYTES;
+    records = (const DictRecord *)(heap + heap_bytes);
+    return true;
+  }
+  void close() {
+    if (data) {
+      munmap((void *)data, size);
+      data = NULL;
+    }
+  }
+  // Index of the first record at or after from with a key no less than key.
+  uint64_t seek(const uint64_t key, uint64_t from) const {
+    // Gallop, as keys sought in increasing order are mostly close together.
+    uint64_t step = 1;
+    while (from + step < n_records && records[from + step].key < key) {
+      from += step;
+      step *= 2;
+    }
+    const auto last = min(from + step + 1, n_records);
+    return lower_bound(records + from, records + last, key,
+                       [](const DictRecord &r, const uint64_t k) { return r.key < k; }) -
+           records;
+  }
+  const char *annotation(const uint64_t i, uint64_t &length) const {
+    const auto end = i + 1 < n_records ? records[i + 1].offset : heap_bytes;
+    // Trim the padding after the last annotation.
+    length = end - records[i].offset;
+    while (length && heap[records[i].offset + length - 1] == '\0') {
+      --length;
+    }
+    return heap + records[i].offset;
+  }
+};
+
+// Both allele counts of one SNP site, as gt_pro parse emits them.
+struct SiteCounts {
+  uint64_t species;
+  uint64_t position;
+  uint64_t counts[2];
+  bool operator<(const SiteCounts &other) const {
+    return species < other.species || (species == other.species && position < other.position);
+  }
+};
+
+// Appends to sites the rows in alleles, one per allele of a site, paired up by site in order of
+// species and position.  Rows of gt_pro output are in order of SNP id, where a species' ids come
+// in runs by number of digits, so this takes a sort of the rows, if not of the hits they count.
+void pair_alleles(vector<SiteCounts> &alleles, vector<SiteCounts> &sites) {
+  stable_sort(alleles.begin(), alleles.end());
+  for (const auto &a : alleles) {
+    if (sites.empty() || sites.back() < a) {
+      sites.push_back(a);
+    } else {
+      sites.back().counts[0] += a.counts[0];
+      sites.back().counts[1] += a.counts[1];
+    }
+  }
+}
+
+// Writes the annotation of each site in the binary dictionary, followed by the counts of both
+// alleles, in order of sites;  this only reads the records near each site and the annotations of
+// those with counts.  Sites missing from the dictionary are left out, as scripts/gtp_parse.py does.
+void annotate_with_binary_dict(const BinaryDict &dict, const vector<SiteCounts> &sites, FILE *out) {
+  uint64_t i = 0;
+  for (const auto &site : sites) {
+    const auto key = site_key(site.species, site.position);
+    for (i = dict.seek(key, i); i < dict.n_records && dict.records[i].key == key; ++i) {
+      uint64_t length;
+      const auto annotation = dict.annotation(i, length);
+      fwrite(annotation, 1, length, out);
+      fprintf(out, "\t%" PRId64 "\t%" PRId64 "\n", site.counts[0], site.counts[1]);
+    }
+  }
+}
+
+// Runs f(t) for t in [0, n), each on a thread of its own but the first, and waits for all.
+template <class F> void run_in_parallel(const int n, F f) {
+  vector<thread> workers;
+  for (int t = 1; t < n; ++t) {
+    workers.push_back(thread(f, t));
+  }
+  f(0);
+  for (auto &w : workers) {
+    w.join();
+  }
+}
+
+// Sorting the matches of an input into counts per SNP, for write_output.
+//
+// Matches are real SNP ids, at most 56 bits, and their distribution is anything but uniform:  a
+// species' ids cluster in a few narrow ranges, one per number of digits in its positions.  So
+// rather than split them by leading bits, which would leave an abundant species to one thread,
+// they are LSD radix sorted, RADIX_DIGIT_BITS of their offset from the least id at a time, with
+// each thread counting the digits of, and scattering, its own slice;  digits all ids share take
+// no pass.  Each thread then counts the runs of equal ids in its slice of the sorted ids.
+constexpr uint64_t RADIX_MIN_KEYS = 1 << 16;
+constexpr int RADIX_DIGIT_BITS = 11;
+constexpr uint64_t RADIX_BINS = LSB << RADIX_DIGIT_BITS;
+
+// The distinct SNP ids of a sorted vector of matches and the count of each, slice by slice.
+struct SortedRuns {
+  const uint64_t *ids;
+  const uint64_t *counts; // NULL if each id counts once, and equal ids are adjacent instead
+  vector<pair<uint64_t, uint64_t>> slices; // start and number of ids in each slice
+  SortedRuns() : ids(NULL), counts(NULL) {}
+  // Calls f(id, count) for each distinct id, in increasing order, while f returns true.
+  template <class F> bool for_each(F f) const {
+    auto any = false;
+    uint64_t id = 0, count = 0;
+    for (const auto &slice : slices) {
+      for (auto i = slice.first; i < slice.first + slice.second; ++i) {
+        const auto c = counts ? counts[i] : 1;
+        if (any && ids[i] == id) {
+          count += c;
+          continue;
+        }
+        if (any && !(f(id, count))) {
+          return false;
+        }
+        id = ids[i];
+        count = c;
+        any = true;
+      }
+    }
+    return !(any) || f(id, count);
+  }
+};
+
+// Sorts keys and counts the runs of equal keys into runs, with up to n_threads threads.  Unless
+// use_scratch is false, or keys are too few to gain from it, this radix sorts through scratch,
+// which grows to the size of keys;  then keys is left holding the distinct ids of each slice,
+// and scratch their counts.  Both must outlive runs.
+void sort_runs(vector<uint64_t> &keys, vector<uint64_t> &scratch, const int n_threads, const bool use_scratch,
+               SortedRuns &runs) {
+  const uint64_t n = keys.size();
+  runs.ids = keys.data();
+  runs.counts = NULL;
+  runs.slices.clear();
+  if (n < RADIX_MIN_KEYS || !(use_scratch)) {
+    sort(keys.begin(), keys.end());
+    runs.slices.push_back(make_pair(0, n));
+    return;
+  }
+  scratch.resize(n);
+  const int n_slices = max<uint64_t>(1, min<uint64_t>(n_threads, n / RADIX_MIN_KEYS));
+  auto slice_start = [&](const int t) -> uint64_t { return n * t / n_slices; };
+  vector<uint64_t> lo(n_slices), hi(n_slices);
+  run_in_parallel(n_slices, [&](const int t) {
+    const auto p = minmax_element(keys.begin() + slice_start(t), keys.begin() + slice_start(t + 1));
+    lo[t] = *(p.first);
+    hi[t] = *(p.second);
+  });
+  const auto base = *min_element(lo.begin(), lo.end());
+  const auto span = *max_element(hi.begin(), hi.end()) - base;
+  const int span_bits = span ? 64 - __builtin_clzll(span) : 0;
+  uint64_t *src = keys.data();
+  uint64_t *dst = scratch.data();
+  vector<uint64_t> bins(n_slices * RADIX_BINS);
+  for (int shift = 0; shift < span_bits; shift += RADIX_DIGIT_BITS) {
+    auto digit = [&](const uint64_t key) { return ((key - base) >> shift) & (RADIX_BINS - 1); };
+    run_in_parallel(n_slices, [&](const int t) {
+      auto *b = &(bins[t * RADIX_BINS]);
+      fill(b, b + RADIX_BINS, 0);
+      for (auto i = slice_start(t); i < slice_start(t + 1); ++i) {
+        ++b[digit(src[i])];
+      }
+    });
+    // From counts to where each slice scatters each digit value, in order of value, then slice.
+    uint64_t offset = 0;
+    auto shared_digit = false;
+    for (uint64_t v = 0; v < RADIX_BINS; ++v) {
+      const auto value_start = offset;
+      for (int t = 0; t < n_slices; ++t) {
+        const auto c = bins[t * RADIX_BINS + v];
+        bins[t * RADIX_BINS + v] = offset;
+        offset += c;
+      }
+      shared_digit = shared_digit || offset - value_start == n;
+    }
+    if (shared_digit) {
+      continue;
+    }
+    run_in_parallel(n_slices, [&](const int t) {
+      auto *b = &(bins[t * RADIX_BINS]);
+      for (auto i = slice_start(t); i < slice_start(t + 1); ++i) {
+        dst[b[digit(src[i])]++] = src[i];
+      }
+    });
+    swap(src, dst);
+  }
+  // Each slice's distinct ids go to the start of its range in keys, and their counts to the same
+  // indices in scratch.  Neither write can overtake the reads from src, whichever of the two it is.
+  uint64_t *ids = keys.data();
+  uint64_t *counts = scratch.data();
+  runs.slices.resize(n_slices);
+  run_in_parallel(n_slices, [&](const int t) {
+    const auto start = slice_start(t);
+    const auto end = slice_start(t + 1);
+    auto j = start;
+    for (auto i = start; i < end;) {
+      const auto id = src[i];
+      auto k = i + 1;
+      while (k < end && src[k] == id) {
+        ++k;
+      }
+      ids[j] = id;
+      counts[j] = k - i;
+      ++j;
+      i = k;
+    }
+    runs.slices[t] = make_pair(start, j - start);
+  });
+  runs.counts = counts;
+}
+
+// K-way merges readers, each with rows in increasing order of SNP id, with the next row of each in a
+// min-heap.  Calls f(snp, count) with the summed count of each SNP, in order, while f returns true.
+// Returns false if f stops it, or at a row out of order;  then bad_reader is the index of its reader,
+// and bad_snp its SNP id.
+template <class Reader, class F>
+bool merge_counts(const vector<Reader *> &readers, F f, int &bad_reader, uint64_t &bad_snp) {
+  using Head = tuple<uint64_t, int, uint64_t>; // snp, reader, count
+  priority_queue<Head, vector<Head>, greater<Head>> heads;
+  vector<uint64_t> last_snp(readers.size(), 0);
+  vector<bool> started(readers.size(), false);
+  bad_reader = -1;
+  auto advance = [&](const int i) {
+    uint64_t snp, count;
+    if (readers[i]->next(snp, count)) {
+      if (started[i] && snp <= last_snp[i]) {
+        bad_reader = i;
+        bad_snp = snp;
+        return;
+      }
+      started[i] = true;
+      last_snp[i] = snp;
+      heads.push(make_tuple(snp, i, count));
+    }
+  };
+  for (int i = 0; i < int(readers.size()); ++i) {
+    advance(i);
+  }
+  while (bad_reader == -1 && !(heads.empty())) {
+    const auto snp = get<0>(heads.top());
+    uint64_t count = 0;
+    while (bad_reader == -1 && !(heads.empty()) && get<0>(heads.top()) == snp) {
+      const auto i = get<1>(heads.top());
+      count += get<2>(heads.top());
+      heads.pop();
+      advance(i);
+    }
+    if (bad_reader != -1 || !(f(snp, count))) {
+      return false;
+    }
+  }
+  return bad_reader == -1;
+}
+
+// The counts of many inputs in a single file, one column per input;  see --cohort.
+//
+// The 8 byte magic "GTPROMAT";  then the column of each input, an OUT_BINARY image, back to back
+// in the order the inputs finish;  then the index, the offset and size of each input's column, in
+// input order;  then the path of each input, as its length and its bytes;  then a 24 byte trailer
+// of the number of inputs, the offset of the index and the magic "GTPROEND".  Integers are little
+// endian uint64.  Columns are written as inputs finish, so memory holds one column per input
+// being written at most, never the whole matrix.
+constexpr char MATRIX_MAGIC[] = "GTPROMAT";
+constexpr uint64_t MATRIX_TRAILER_BYTES = 24;
+
+struct CohortMatrix {
+  const string path;
+  const string tmp_path;
+  FILE *file;
+  mutex mtx;
+  // Offset and size of each input's column;  size 0 until it is written.
+  vector<pair<uint64_t, uint64_t>> columns;
+  uint64_t offset;
+  bool error;
+  CohortMatrix(const string &path, const int n_inputs)
+      : path(path), tmp_path(path + ".tmp"), file(NULL), columns(n_inputs, make_pair(0, 0)), offset(0), error(false) {}
+  ~CohortMatrix() { discard(); }
+  bool open() {
+    errno = 0;
+    file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL) {
+      errno = 0;
+      return false;
+    }
+    offset = fwrite(MATRIX_MAGIC, 1, 8, file);
+    return true;
+  }
+  // Appends the column of input i.  Returns false on a write error.
+  bool add_column(const int i, const char *image, const uint64_t size) {
+    unique_lock<mutex> lk(mtx);
+    if (error || fwrite(image, 1, size, file) != size) {
+      error = true;
+      return false;
+    }
+    columns[i] = make_pair(offset, size);
+    offset += size;
+    return true;
+  }
+  // Writes the index and names after the columns, and moves the matrix into place.
+  // Returns false on a write error.
+  bool finish(const vector<string> &names) {
+    assert(names.size() == columns.size());
+    const auto index_offset = offset;
+    for (const auto &c : columns) {
+      put_le64(file, c.first);
+      put_le64(file, c.second);
+    }
+    for (const auto &name : names) {
+      put_le64(file, name.size());
+      fwrite(name.data(), 1, name.size(), file);
+    }
+    put_le64(file, columns.size());
+    put_le64(file, index_offset);
+    fwrite(BINARY_END_MAGIC, 1, 8, file);
+    const auto ok = !(error) && fflush(file) == 0 && !(ferror(file));
+    fclose(file);
+    file = NULL;
+    if (!(ok) || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      unlink(tmp_path.c_str());
+      errno = 0;
+      return false;
+    }
+    return true;
+  }
+  // Removes a matrix that will not be finished.
+  void discard() {
+    if (file) {
+      fclose(file);
+      file = NULL;
+      unlink(tmp_path.c_str());
+      errno = 0;
+    }
+  }
+};
+
+// Reads the columns of a --cohort matrix, memory mapped.
+struct CohortMatrixReader {
+  const uint8_t *data;
+  uint64_t size;
+  vector<string> names;
+  vector<BinaryCountsReader> columns;
+  CohortMatrixReader() : data(NULL), size(0) {}
+  ~CohortMatrixReader() {
+    if (data) {
+      munmap((void *)data, size);
+    }
+  }
+  static bool is_matrix(const char *path) {
+    char magic[8];
+    FILE *f = fopen(path, "rb");
+    const auto matches = f && fread(magic, 1, 8, f) == 8 && 0 == memcmp(magic, MATRIX_MAGIC, 8);
+    if (f) {
+      fclose(f);
+    }
+    errno = 0;
+    return matches;
+  }
+  // Returns false if path is not a whole matrix.
+  bool open(const char *path) {
+    data = (const uint8_t *)map_file(path, size);
+    if (data == NULL || size < 8 + MATRIX_TRAILER_BYTES || memcmp(data, MATRIX_MAGIC, 8) ||
+        memcmp(data + size - 8, BINARY_END_MAGIC, 8)) {
+      return false;
+    }
+    const auto n = le64(data + size - MATRIX_TRAILER_BYTES);
+    const auto index_offset = le64(data + size - MATRIX_TRAILER_BYTES + 8);
+    if (index_offset > size - MATRIX_TRAILER_BYTES || n > (size - MATRIX_TRAILER_BYTES - index_offset) / 24) {
+      return false;
+    }
+    columns.resize(n);
+    auto p = data + index_offset + 16 * n;
+    const auto names_end = data + size - MATRIX_TRAILER_BYTES;
+    for (uint64_t i = 0; i < n; ++i) {
+      const auto column_offset = le64(data + index_offset + 16 * i);
+      const auto column_size = le64(data + index_offset + 16 * i + 8);
+      if (column_offset > index_offset || column_size > index_offset - column_offset ||
+          !(columns[i].read_image(data + column_offset, column_size))) {
+        return false;
+      }
+      if (p + 8 > names_end || le64(p) > uint64_t(names_end - p - 8)) {
+        return false;
+      }
+      names.push_back(string((const char *)p + 8, le64(p)));
+      p += 8 + le64(p);
+    }
+    return p == names_end;
+  }
+};
+
+struct Result {
+  int channel;
+  const string in_path;
+  string o_name;
+  int n_input_chunks;
+  atomic<int> n_processed_chunks;
+  bool finished_reading;
+  bool done_with_output;
+  vector<uint64_t> *p_kmer_matches;
+  // Until matches are folded into dense counters, each chunk's go on a lock-free list by pointer,
+  // and are gathered into p_kmer_matches once, by write_output, or when they pass the buffer limit.
+  // Chunks hold the capacity their query left them, so that is what counts toward the limit.
+  struct MatchChunk {
+    vector<uint64_t> matches;
+    MatchChunk *next;
+  };
+  atomic<MatchChunk *> chunks;
+  atomic<uint64_t> n_chunked_matches;
+  // Non-NULL once matches have been folded into dense counters;  then p_kmer_matches is NULL.
+  vector<uint32_t> *p_dense_counts;
+  DenseSnpIndex *p_dense;
+  uint64_t match_buffer_limit;
+  atomic<bool> dense;
+  uint64_t chars_read;
+  bool error;
+  bool io_error;
+  bool output_error;
+  bool missing_decompressor;
+  uint64_t error_pos;
+  atomic<uint64_t> n_reads;
+  uint64_t n_snps;
+  long sort_us;
+  long output_us;
+  bool measure_sort_events;
+  uint64_t sort_events[N_HW_EVENTS];
+  // Threads to sort matches with:  as many as the slots in running_threads its writer holds.
+  int sort_threads;
+  FILE *input_file;
+  bool popened;
+  int decomp_idx;
+  // Known from the extension for BAM, else detected from the first bytes of input, before any
+  // of it is queried.
+  InputFormat format;
+  // The R2 file under --paired;  mate_path is empty otherwise.
+  string mate_path;
+  string mate_full_inpath;
+  FILE *mate_file;
+  bool mate_popened;
+  int mate_decomp_idx;
+  string out_path;
+  string err_path;
+  bool skip;
+  mutex *p_print_lock;
+  string full_inpath;
+  // Non-NULL when streaming snapshots of the counts to stdout.
+  const SnapshotPlan *p_snapshots;
+  int n_snapshots;
+  long stream_start_us;
+  uint64_t next_snapshot_reads;
+  long next_snapshot_us;
+  bool wrote_final_snapshot;
+  // Non-NULL when reading stops once genotypes saturate.  Hits and distinct SNPs found per species,
+  // and the reads and distinct SNPs at the start of the current StopPlan::BLOCK_READS block.
+  const StopPlan *p_stop;
+  atomic<bool> saturated;
+  vector<uint64_t> species_hits;
+  vector<uint64_t> species_snps;
+  uint64_t distinct_snps;
+  uint64_t block_start_reads;
+  uint64_t block_start_snps;
+  // Fragments hashing above sample_limit are skipped.  For a --subsample count, the name hash of
+  // each fragment kept so far, and its matches tagged with that hash, which are pruned down to the
+  // count smallest hashes whenever they double;  sample_limit then drops to the largest hash kept.
+  const Subsample *p_subsample;
+  // Reads per fragment, so n_reads counts the reads of a --subsample count, not its fragments, as
+  // with a fraction.
+  int sample_reads_per_fragment;
+  atomic<uint64_t> sample_limit;
+  vector<uint64_t> sample_hashes;
+  vector<pair<uint64_t, uint64_t>> sample_matches;
+  const OutputFormat out_format;
+  // The binary SNP dictionary for OUT_ANNOTATED.
+  const BinaryDict *p_dict;
+  // Non-NULL under --cohort, where counts go to a column of the matrix instead of out_path.
+  CohortMatrix *p_cohort;
+  // Under --spill-dir, matches past match_buffer_limit are sorted into a run of counts in a file
+  // there, an OUT_BINARY image, instead of folded into dense counters;  write_output merges the runs.
+  string spill_dir;
+  vector<string> spill_paths;
+  int n_spills;
+  Result(int channel, const char *in_path, const char *oooname, const string &dbbase, const bool force, mutex *p_print_lock,
+         const string &c_prefix, const char *mate_in_path = NULL, const OutputFormat out_format = OUT_TSV,
+         const BinaryDict *dict = NULL, CohortMatrix *cohort = NULL)
+      : channel(channel), in_path(in_path), n_input_chunks(0), n_processed_chunks(0), finished_reading(false),
+        done_with_output(false), o_name(oooname == NULL ? "" : oooname), p_kmer_matches(new vector<uint64_t>()), chunks(NULL),
+        n_chunked_matches(0), p_dense_counts(NULL), p_dense(NULL), match_buffer_limit(UINT64_MAX), dense(false), chars_read(0),
+        error(false), output_error(false), missing_decompressor(false), error_pos(1ULL << 48), io_error(false), n_reads(0),
+        n_snps(0), sort_us(0), output_us(0), measure_sort_events(false), sort_threads(1), input_file(NULL), popened(false),
+        format(is_bam_path(in_path) ? FORMAT_BAM : FORMAT_UNKNOWN), mate_path(mate_in_path ? mate_in_path : ""),
+        mate_file(NULL), mate_popened(false), skip(false), p_print_lock(p_print_lock), p_snapshots(NULL), n_snapshots(0),
+        stream_start_us(0), next_snapshot_reads(UINT64_MAX), next_snapshot_us(numeric_limits<long>::max()),
+        wrote_final_snapshot(false), p_stop(NULL), saturated(false), distinct_snps(0), block_start_reads(0),
+        block_start_snps(0), p_subsample(NULL), sample_reads_per_fragment(1), sample_limit(UINT64_MAX), out_format(out_format),
+        p_dict(dict), p_cohort(cohort), n_spills(0) {
+    decomp_idx = decompressor(in_path);
+    mate_decomp_idx = mate_path.empty() ? -1 : decompressor(mate_path.c_str());
+    const char *compext = "";
+    if (decomp_idx != -1 && out_format != OUT_BINARY) {
+      // compress output with same compressor as input;  BAM inputs get gzip compatible output
+      compext = is_bam_path(in_path) ? ".gz" : compressors[decomp_idx][0];
+    }
+    if (o_name.empty()) {
+      out_path = "/dev/stdout";
+      err_path = "/dev/stderr";
+    }
+    auto prefixed = [&](const string &path) -> string {
+      if (c_prefix.empty()) {
+        return path;
+      } else if (path[0] == '/') {
+        cerr << chrono_time() << ": [WARNING] Ignoring specified -C prefix for non-relative input path: " << path << endl;
+        return path;
+      }
+      return c_prefix + "/" + path;
+    };
+    full_inpath = prefixed(in_path);
+    if (!(mate_path.empty())) {
+      mate_full_inpath = prefixed(mate_path);
+    }
+    // Create a unique tag 'inbase' from the input path, to include in the
+    // output prefix where indicated by %{in}.  For instance, if the input
+    // path is /foo/bar123/r1.fastq.lz4, then inbase would be foo_bar123_r1.
+    // The -C prefix, if any, is intentionally not included.
+    const bool special = (0 == strncmp(out_path.c_str(), "/dev/", 5));
+    if (!(special)) {
+      // First, chop off compressor and format extensions.
+      string inbase = chopext(in_path, decomp_idx);
+      // Chop off all initial '.' and '/' characters.  Those would otherwise
+      // turn into leading underscores later.  Could use regex_replace,
+      // but this also works.
+      int nsi = 0;
+      while (nsi < inbase.size() && (inbase[nsi] == '/' || inbase[nsi] == '.')) {
+        ++nsi;
+      }
+      if (nsi) {
+        inbase = inbase.substr(nsi, inbase.size() - nsi);
+      }
+      // Replace all '/' and '.' with '_'
+      inbase = regex_replace(inbase, regex("\\."), "_");
+      inbase = regex_replace(inbase, regex("/"), "_");
+      // Replace %{in} with inbase in output prefix.
+      o_name = regex_replace(o_name, regex("%\\{in\\}"), inbase);
       // Replace %{n} with channel in output prefix.
       o_name = regex_replace(o_name, regex("%\\{n\\}"), to_string(channel));
       // Replace %{db} with dbbase in output prefix.
       o_name = regex_replace(o_name, regex("%\\{db\\}"), dbbase);
-      // Output will be compressed with the same format as input.
-      out_path = o_name + ".tsv" + compext;
+      // Text output will be compressed with the same format as input;  binary output is compact
+      // already, and stays uncompressed so it can be memory mapped.
+      out_path = o_name + (out_format == OUT_BINARY ? ".gtpb" : ".tsv") + compext;
       err_path = o_name + ".err";
     }
-    auto output_exists = !(special) && file_exists(out_path.c_str());
+    if (p_cohort) {
+      // The matrix is written whole on every run.
+      out_path = "/dev/null";
+    }
+    auto output_exists = !(special) && !(p_cohort) && file_exists(out_path.c_str());
     auto error_exists = !(special) && file_exists(err_path.c_str());
     if (force || error_exists || !(output_exists)) {
       if (output_exists && !(error_exists)) {
@@ -883,54 +2604,70 @@ struct Result {
     }
   }
   ~Result() {
-    if (p_kmer_matches) {
-      delete p_kmer_matches;
-      p_kmer_matches = NULL;
-    }
+    free_matches();
     close_input();
   }
   void open_input() {
+    input_file = open_file(in_path, full_inpath, decomp_idx, popened);
+    if (!(mate_path.empty()) && !(error)) {
+      mate_file = open_file(mate_path, mate_full_inpath, mate_decomp_idx, mate_popened);
+    }
+    if (p_stop && !(error)) {
+      count_densely(p_dense);
+      species_hits.assign(p_dense->n_species, 0);
+      species_snps.assign(p_dense->n_species, 0);
+    }
+  }
+  FILE *open_file(const string &path, const string &full_path, const int decomp, bool &was_popened) {
     assert(errno == 0);
-    if (decomp_idx == -1) { // no decomprefssion required
-      popened = false;
-      input_file = fopen(in_path.c_str(), "r");
+    FILE *file = NULL;
+    if (decomp == -1) { // no decomprefssion required
+      was_popened = false;
+      file = fopen(path.c_str(), "r");
     } else {
-      popened = true;
-      auto &decomp = compressors[decomp_idx];
-      if (0 == strcmp(decomp[2], "tested_and_does_not_work")) {
+      was_popened = true;
+      auto &decomp_cmd = compressors[decomp];
+      if (0 == strcmp(decomp_cmd[2], "tested_and_does_not_work")) {
         cerr << chrono_time() << ":  "
-             << "[ERROR] Required decompressor " << decomp[1] << " is unavailable: " << in_path << endl;
+             << "[ERROR] Required decompressor " << decomp_cmd[1] << " is unavailable: " << path << endl;
         missing_decompressor = true;
         note_io_error();
       } else {
-        assert(0 == strcmp(decomp[2], "tested_and_works"));
-        input_file = popen_decompressor(decomp[1], full_inpath.c_str());
+        assert(0 == strcmp(decomp_cmd[2], "tested_and_works"));
+        file = popen_decompressor(decomp_cmd[1], full_path.c_str());
       }
     }
-    if (errno || input_file == NULL || ferror(input_file)) {
+    if (errno || file == NULL || ferror(file)) {
       note_io_error();
     }
+    return file;
   }
   void close_input() {
+    close_file(input_file, popened);
+    close_file(mate_file, mate_popened);
+    finished_reading = true;
+  }
+  void close_file(FILE *&file, const bool was_popened) {
     errno = 0;
-    if (input_file) {
-      if (popened) {
-        pclose(input_file);
+    if (file) {
+      if (was_popened) {
+        pclose(file);
       } else {
-        fclose(input_file);
+        fclose(file);
       }
-      input_file = NULL;
+      file = NULL;
       if (errno) {
         note_io_error();
       }
     }
-    finished_reading = true;
   }
+  bool input_failed() { return (input_file && ferror(input_file)) || (mate_file && ferror(mate_file)); }
   void note_io_error(bool quiet = false) {
     error_pos = min(error_pos, chars_read);
     if (!(error) && !(quiet)) {
       cerr << chrono_time() << ":  "
-           << "[ERROR] Failed to read past position " << error_pos << " in presumed FASTQ file " << full_inpath << endl;
+           << "[ERROR] Failed to read past position " << error_pos << " in presumed FASTQ, FASTA or BAM file "
+           << full_inpath << endl;
     }
     io_error = true;
     error = true;
@@ -949,20 +2686,138 @@ struct Result {
     if (output_error) {
       fh << "[ERROR] Failed to write to output file." << endl;
     } else if (missing_decompressor) {
-      fh << "[ERROR] Decompressor " << compressors[decomp_idx][1] << " is unavailable for input " << in_path << endl;
+      const auto missing_idx = mate_decomp_idx != -1 && 0 == strcmp(compressors[mate_decomp_idx][2], "tested_and_does_not_work")
+                                   ? mate_decomp_idx
+                                   : decomp_idx;
+      fh << "[ERROR] Decompressor " << compressors[missing_idx][1] << " is unavailable for input " << in_path << endl;
     } else if (io_error) {
       // I/O errors are reported on stderr in realtime.  Note them in the .err file.
-      fh << "[ERROR] Failed to read past position " << error_pos << " in presumed FASTQ file " << in_path << endl;
+      fh << "[ERROR] Failed to read past position " << error_pos << " in presumed FASTQ, FASTA or BAM file " << in_path << endl;
     } else {
-      fh << "[ERROR] Failed to parse somewhere past position " << error_pos << " in presumed FASTQ file " << in_path << endl;
+      fh << "[ERROR] Failed to parse somewhere past position " << error_pos << " in presumed FASTQ, FASTA or BAM file "
+         << in_path << endl;
       unique_lock<mutex> lk(*p_print_lock);
       cerr << chrono_time() << ":  "
-           << "[ERROR] Failed to parse somewhere past position " << error_pos << " in presumed FASTQ file " << in_path << endl;
+           << "[ERROR] Failed to parse somewhere past position " << error_pos << " in presumed FASTQ, FASTA or BAM file "
+           << in_path << endl;
     }
     fh.close();
+    free_matches();
+    remove_output();
+  }
+  void free_matches() {
+    for (auto *chunk = chunks.exchange(NULL); chunk;) {
+      auto *next = chunk->next;
+      delete chunk;
+      chunk = next;
+    }
+    n_chunked_matches = 0;
     delete p_kmer_matches;
     p_kmer_matches = NULL;
-    remove_output();
+    delete p_dense_counts;
+    p_dense_counts = NULL;
+    vector<uint64_t>().swap(species_hits);
+    vector<uint64_t>().swap(species_snps);
+    for (const auto &path : spill_paths) {
+      unlink(path.c_str());
+    }
+    spill_paths.clear();
+  }
+  // Count in dense counters from the start.
+  void count_densely(DenseSnpIndex *dense_index) {
+    if (p_dense_counts) {
+      return;
+    }
+    p_dense = dense_index;
+    p_dense_counts = new vector<uint32_t>(p_dense->ids().size());
+    delete p_kmer_matches;
+    p_kmer_matches = NULL;
+    dense = true;
+  }
+  // Write snapshots of the dense counters as the plan says.
+  void stream_snapshots(DenseSnpIndex *dense_index, const SnapshotPlan *plan) {
+    count_densely(dense_index);
+    p_snapshots = plan;
+    stream_start_us = steady_time_us();
+    schedule_snapshot();
+  }
+  // Stop reading once the plan's coverage or new SNP rate target is met.  The counters are only
+  // allocated by open_input, and freed with the matches once output is written, so only the
+  // inputs in flight hold them.
+  void stop_when_saturated(DenseSnpIndex *dense_index, const StopPlan *plan) {
+    p_dense = dense_index;
+    p_dense->species();
+    p_stop = plan;
+  }
+  // Count only the fragments the plan samples.
+  void subsample(const Subsample *plan, const int reads_per_fragment) {
+    p_subsample = plan;
+    sample_reads_per_fragment = reads_per_fragment;
+    sample_limit = plan->initial_limit();
+  }
+  // Under --max-ram or --match-buffer-mb, fold matches into dense counters once they take more
+  // than buffer_bytes.
+  void limit_match_buffer(DenseSnpIndex *dense_index, const uint64_t buffer_bytes) {
+    p_dense = dense_index;
+    // Allow for the vector's capacity to double past its size.
+    match_buffer_limit = buffer_bytes / (2 * sizeof(uint64_t));
+  }
+  // Spill matches to runs under dir once they take more than buffer_bytes.
+  void spill_to(const string &dir, const uint64_t buffer_bytes) {
+    spill_dir = dir;
+    match_buffer_limit = min(match_buffer_limit, buffer_bytes / (2 * sizeof(uint64_t)));
+  }
+  // Whether the radix sort's scratch fits in the room the buffer limit leaves for the vector's
+  // capacity to double.
+  bool scratch_fits(const vector<uint64_t> &matches) const {
+    return match_buffer_limit == UINT64_MAX || matches.size() + matches.capacity() <= 2 * match_buffer_limit;
+  }
+  // Sort matches into a run of counts in a new file under spill_dir, and free them.  Returns false
+  // if the file cannot be written.
+  bool spill(vector<uint64_t> &matches, const int spill_id, const int n_threads) {
+    const auto path =
+        spill_dir + "/gt_pro_spill." + to_string(getpid()) + "." + to_string(channel) + "." + to_string(spill_id) + ".gtpb";
+    {
+      unique_lock<mutex> lk(mtx);
+      spill_paths.push_back(path);
+    }
+    vector<uint64_t> scratch;
+    SortedRuns runs;
+    sort_runs(matches, scratch, n_threads, scratch_fits(matches), runs);
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL) {
+      return false;
+    }
+    fwrite(BINARY_MAGIC, 1, 8, f);
+    string chunk;
+    uint64_t previous_snp = 0, rows = 0, hits = 0;
+    runs.for_each([&](const uint64_t snp, const uint64_t count) {
+      append_varint(chunk, snp - previous_snp);
+      append_varint(chunk, count);
+      previous_snp = snp;
+      ++rows;
+      hits += count;
+      if (chunk.size() >= OUTPUT_CHUNK_BYTES) {
+        fwrite(chunk.data(), 1, chunk.size(), f);
+        chunk.clear();
+      }
+      return true;
+    });
+    fwrite(chunk.data(), 1, chunk.size(), f);
+    put_le64(f, rows);
+    put_le64(f, hits);
+    put_le64(f, 0);
+    fwrite(BINARY_END_MAGIC, 1, 8, f);
+    vector<uint64_t>().swap(matches);
+    const auto written = fflush(f) == 0 && !(ferror(f));
+    return fclose(f) == 0 && written;
+  }
+  void note_spill_error(const int spill_id) {
+    unique_lock<mutex> lk(*p_print_lock);
+    cerr << chrono_time() << ":  [ERROR] Failed to write run " << spill_id << " of the matches for " << in_path << " under "
+         << spill_dir << endl;
+    errno = 0;
+    output_error = true;
   }
   void remove_file(const string &path, const string placeholder_text = "") {
     if (0 == strncmp(path.c_str(), "/dev/", 5)) { // do not delete /dev/std{out, err}, /dev/null, etc.
@@ -994,16 +2849,46 @@ struct Result {
             "must have been aborted in the middle of a computation, without a chance to record a more helpful error message.  "
             "If that's the case, don't trust any result files that may have been produced for this input.");
   }
-  void write_output() {
+  // Calls sorted once the CPU heavy part of the work is done;  the rest mostly waits on writes to
+  // the output file or compressor.
+  void write_output(const function<void()> &sorted = [] {}) {
+    if (!(error)) {
+      gather_chunks();
+    }
+    if (p_subsample && p_subsample->count && !(error)) {
+      // All chunks are merged;  the sample is final once pruned.
+      prune_sample();
+      n_reads = sample_hashes.size() * sample_reads_per_fragment;
+      p_kmer_matches->clear();
+      for (const auto &m : sample_matches) {
+        p_kmer_matches->push_back(m.second);
+      }
+      vector<pair<uint64_t, uint64_t>>().swap(sample_matches);
+      vector<uint64_t>().swap(sample_hashes);
+    }
     {
       unique_lock<mutex> lk(*p_print_lock);
       cerr << chrono_time() << ":  "
-           << "[Done] searching is completed for the " << n_reads << " reads input from " << in_path << endl;
+           << "[Done] searching is completed for the " << n_reads << " reads input from " << in_path
+           << (saturated ? ", stopped early at the --stop-coverage or --stop-new-snps target" : "") << endl;
     }
-    if (error) {
+    if (error || output_error) {
       write_error_info();
       return;
     }
+    if (p_snapshots) {
+      {
+        unique_lock<mutex> lk(mtx);
+        write_snapshot(lk, true);
+      }
+      if (output_error) {
+        write_error_info();
+        return;
+      }
+      free_matches();
+      remove_error();
+      return;
+    }
     FILE *out_file;
     auto check_output_error = [&](int code_line) -> bool {
       if (out_file == NULL || ferror(out_file)) {
@@ -1022,7 +2907,13 @@ struct Result {
       }
       return false;
     };
-    if (decomp_idx != -1) {
+    const bool compressed = decomp_idx != -1 && out_format != OUT_BINARY && !(p_cohort);
+    // Under --cohort, the column is an OUT_BINARY image, written to the matrix whole.
+    char *column = NULL;
+    size_t column_size = 0;
+    if (p_cohort) {
+      out_file = open_memstream(&column, &column_size);
+    } else if (compressed) {
       out_file = popen_compressor(compressors[decomp_idx][1], out_path.c_str());
     } else {
       out_file = fopen(out_path.c_str(), "w");
@@ -1030,29 +2921,129 @@ struct Result {
     if (check_output_error(__LINE__)) {
       return;
     }
-    if (p_kmer_matches->size() == 0) {
+    // Rows come in increasing order of SNP id.
+    const bool binary = out_format == OUT_BINARY || p_cohort;
+    const bool annotated = out_format == OUT_ANNOTATED;
+    uint64_t previous_snp = 0;
+    uint64_t n_hits = 0;
+    // Under OUT_ANNOTATED, each row is one allele of a site, written once all are paired up.
+    vector<SiteCounts> alleles;
+    string chunk;
+    chunk.reserve(OUTPUT_CHUNK_BYTES + 64);
+    auto write_chunk = [&]() {
+      fwrite(chunk.data(), 1, chunk.size(), out_file);
+      chunk.clear();
+    };
+    auto write_row = [&](const uint64_t snp, const uint64_t count) {
+      ++n_snps;
+      n_hits += count;
+      if (binary) {
+        append_varint(chunk, snp - previous_snp);
+        append_varint(chunk, count);
+        previous_snp = snp;
+      } else if (annotated) {
+        SiteCounts site = {0, 0, {0, 0}};
+        uint64_t allele;
+        if (split_snp_id(snp, site.species, allele, site.position) && allele <= 1) {
+          site.counts[allele] = count;
+          alleles.push_back(site);
+        }
+      } else {
+        append_decimal(chunk, snp);
+        chunk += '\t';
+        append_decimal(chunk, count);
+        chunk += '\n';
+      }
+      if (chunk.size() >= OUTPUT_CHUNK_BYTES) {
+        write_chunk();
+      }
+    };
+    if (binary) {
+      fwrite(BINARY_MAGIC, 1, 8, out_file);
+    }
+    if (p_dense_counts) {
+      // Counters are indexed by rank of the real SNP id, so output comes out sorted as is.
+      sorted();
+      const auto &ids = p_dense->ids();
+      for (uint64_t i = 0; i < ids.size(); ++i) {
+        const uint64_t count = (*p_dense_counts)[i];
+        if (count == 0) {
+          continue;
+        }
+        write_row(ids[i], count);
+        if (check_output_error(__LINE__)) {
+          return;
+        }
+      }
+      {
+        unique_lock<mutex> lk(*p_print_lock);
+        cerr << chrono_time() << ":  "
+             << "[Stats] " << n_snps << " snps, " << n_reads << " reads, " << int((((double)n_hits) / n_snps) * 100) / 100.0
+             << " hits/snp, for " << in_path << endl;
+      }
+    } else if (p_kmer_matches->size() == 0 && spill_paths.empty()) {
       unique_lock<mutex> lk(*p_print_lock);
       cerr << chrono_time() << ":  "
            << "[WARNING] found zero hits for the " << n_reads << " reads input from " << in_path << endl;
     } else {
       // For each kmer output how many times it occurs in kmer_matches.
-      sort(p_kmer_matches->begin(), p_kmer_matches->end());
-      const uint64_t end = p_kmer_matches->size();
-      uint64_t i = 0;
-      uint64_t n_snps = 0;
-      uint64_t n_hits = 0;
-      while (i != end) {
-        uint64_t j = i + 1;
-        while (j != end && (*p_kmer_matches)[i] == (*p_kmer_matches)[j]) {
-          ++j;
+      const auto t_sort = steady_time_us();
+      PerfEventGroup events(measure_sort_events);
+      events.start();
+      vector<uint64_t> scratch;
+      SortedRuns runs;
+      // With runs spilled, the rest of the matches make one more, and the runs are merged from disk.
+      vector<unique_ptr<BinaryCountsReader>> spilled;
+      if (spill_paths.empty()) {
+        sort_runs(*p_kmer_matches, scratch, sort_threads, scratch_fits(*p_kmer_matches), runs);
+      } else {
+        const auto spill_id = n_spills++;
+        if (!(spill(*p_kmer_matches, spill_id, sort_threads))) {
+          note_spill_error(spill_id);
+          write_error_info();
+          return;
         }
-        ++n_snps;
-        n_hits += (j - i);
-        fprintf(out_file, "%" PRId64 "\t%" PRId64 "\n", (*p_kmer_matches)[i], (j - i));
-        if (check_output_error(__LINE__)) {
+        for (const auto &path : spill_paths) {
+          spilled.emplace_back(new BinaryCountsReader());
+          if (!(spilled.back()->open(path))) {
+            note_spill_error(spilled.size() - 1);
+            write_error_info();
+            return;
+          }
+        }
+      }
+      events.stop(sort_events);
+      sort_us = steady_time_us() - t_sort;
+      sorted();
+      auto write_counted = [&](const uint64_t snp, const uint64_t count) {
+        write_row(snp, count);
+        return !(check_output_error(__LINE__));
+      };
+      if (spilled.empty()) {
+        if (!(runs.for_each(write_counted))) {
+          return;
+        }
+      } else {
+        vector<BinaryCountsReader *> sources;
+        for (const auto &reader : spilled) {
+          sources.push_back(reader.get());
+        }
+        int bad_reader;
+        uint64_t bad_snp;
+        if (!(merge_counts(sources, write_counted, bad_reader, bad_snp))) {
+          if (bad_reader != -1) {
+            note_spill_error(bad_reader);
+            write_error_info();
+          }
           return;
         }
-        i = j;
+        for (uint64_t i = 0; i < spilled.size(); ++i) {
+          if (spilled[i]->malformed()) {
+            note_spill_error(i);
+            write_error_info();
+            return;
+          }
+        }
       }
       {
         unique_lock<mutex> lk(*p_print_lock);
@@ -1061,16 +3052,44 @@ struct Result {
              << " hits/snp, for " << in_path << endl;
       }
     }
-    if (decomp_idx == -1) {
-      fclose(out_file);
-    } else {
-      pclose(out_file);
+    write_chunk();
+    if (annotated) {
+      vector<SiteCounts> sites;
+      pair_alleles(alleles, sites);
+      vector<SiteCounts>().swap(alleles);
+      annotate_with_binary_dict(*p_dict, sites, out_file);
+    }
+    if (binary) {
+      put_le64(out_file, n_snps);
+      put_le64(out_file, n_hits);
+      put_le64(out_file, n_reads);
+      fwrite(BINARY_END_MAGIC, 1, 8, out_file);
     }
+    // Flush so that write errors show before the file is closed.
+    fflush(out_file);
     if (check_output_error(__LINE__)) {
       return;
     }
-    delete p_kmer_matches;
-    p_kmer_matches = NULL;
+    if (compressed) {
+      pclose(out_file);
+    } else {
+      fclose(out_file);
+    }
+    if (p_cohort) {
+      const auto added = p_cohort->add_column(channel, column, column_size);
+      free(column);
+      if (!(added)) {
+        {
+          unique_lock<mutex> lk(*p_print_lock);
+          cerr << chrono_time() << ":  "
+               << "[ERROR] Error writing the column of " << in_path << " to " << p_cohort->tmp_path << endl;
+          output_error = true;
+        }
+        write_error_info();
+        return;
+      }
+    }
+    free_matches();
     remove_error();
   }
   bool pending_output() {
@@ -1082,29 +3101,362 @@ struct Result {
       return n_input_chunks == n_processed_chunks;
     }
   }
-  void merge_kmer_matches(vector<uint64_t> &kmt, const int64_t n_reads_chunk) {
+  // With a --subsample count, sampled holds the hash and number of matches of each fragment kept.
+  void merge_kmer_matches(vector<uint64_t> &kmt, const int64_t n_reads_chunk, const vector<uint64_t> *sampled = NULL) {
+    if (sampled) {
+      merge_sampled(kmt, *sampled);
+      return;
+    }
+    if (!(dense)) {
+      push_chunk(kmt, n_reads_chunk);
+      return;
+    }
+    // Ranking takes a binary search per match;  do it before taking the lock.
+    p_dense->rank(kmt);
     unique_lock<mutex> lk(mtx);
-    p_kmer_matches->insert(p_kmer_matches->end(), kmt.begin(), kmt.end());
+    if (p_stop) {
+      const auto &species = p_dense->species();
+      for (const auto rank : kmt) {
+        const auto sp = species[rank];
+        if ((*p_dense_counts)[rank]++ == 0) {
+          ++distinct_snps;
+          ++species_snps[sp];
+        }
+        ++species_hits[sp];
+      }
+    } else {
+      for (const auto rank : kmt) {
+        ++(*p_dense_counts)[rank];
+      }
+    }
     ++n_processed_chunks;
     if (n_reads_chunk >= 0) {
       n_reads += n_reads_chunk;
     }
+    if (p_stop && !(saturated)) {
+      check_saturation();
+    }
+    if (p_snapshots && (n_reads >= next_snapshot_reads || steady_time_us() >= next_snapshot_us)) {
+      write_snapshot(lk, false);
+    }
+  }
+  // Write a --snapshot-secs snapshot that is due even though no reads arrived to trigger it.
+  void snapshot_if_due() {
+    unique_lock<mutex> lk(mtx);
+    if (!(wrote_final_snapshot) && steady_time_us() >= next_snapshot_us) {
+      write_snapshot(lk, false);
+    }
   }
 
 private:
   mutex mtx;
+  mutex snapshot_mtx;
+  vector<uint32_t> snapshot_counts;
+  // Push the chunk's matches onto the list, which takes them over, without a copy or mtx.
+  void push_chunk(vector<uint64_t> &kmt, const int64_t n_reads_chunk) {
+    const uint64_t n = kmt.capacity();
+    // Counted before it is published, so that a gather_chunks taking it never subtracts first.
+    const auto buffered = n_chunked_matches.fetch_add(n) + n;
+    if (n) {
+      auto *chunk = new MatchChunk();
+      chunk->matches.swap(kmt);
+      chunk->next = chunks.load(memory_order_relaxed);
+      while (!(chunks.compare_exchange_weak(chunk->next, chunk, memory_order_release, memory_order_relaxed))) {
+      }
+    }
+    if (n_reads_chunk >= 0) {
+      n_reads += n_reads_chunk;
+    }
+    if (buffered > match_buffer_limit) {
+      unique_lock<mutex> lk(mtx);
+      // Another chunk may have relieved the buffer while this one waited for the lock.
+      if (n_chunked_matches > match_buffer_limit) {
+        relieve_match_buffer(lk);
+      }
+    }
+    // Counted only once its matches are on the list, or spilled, so write_output finds them all.
+    ++n_processed_chunks;
+  }
+  // Called with mtx held, or after all chunks are merged.  Chunks pushed after the switch to
+  // dense counters, by queries that had not seen it yet, go to the counters.
+  void gather_chunks() {
+    auto *chunk = chunks.exchange(NULL, memory_order_acquire);
+    uint64_t n = 0, gathered = 0;
+    for (auto *c = chunk; c; c = c->next) {
+      n += c->matches.size();
+    }
+    if (!(p_dense_counts)) {
+      p_kmer_matches->reserve(p_kmer_matches->size() + n);
+    }
+    while (chunk) {
+      auto &matches = chunk->matches;
+      gathered += matches.capacity();
+      if (p_dense_counts) {
+        p_dense->rank(matches);
+        for (const auto rank : matches) {
+          ++(*p_dense_counts)[rank];
+        }
+      } else {
+        p_kmer_matches->insert(p_kmer_matches->end(), matches.begin(), matches.end());
+      }
+      auto *next = chunk->next;
+      delete chunk;
+      chunk = next;
+    }
+    n_chunked_matches -= gathered;
+  }
+  // Called with mtx held once chunked matches pass the buffer limit.
+  void relieve_match_buffer(unique_lock<mutex> &lk) {
+    gather_chunks();
+    if (p_dense_counts) {
+      return;
+    }
+    if (spill_dir.empty()) {
+      switch_to_dense_counters();
+      return;
+    }
+    // Spill without holding the lock, so other chunks of this input can merge meanwhile;  the
+    // chunk counts as processed only once its run is written.
+    vector<uint64_t> run;
+    run.swap(*p_kmer_matches);
+    const auto spill_id = n_spills++;
+    lk.unlock();
+    const auto spilled = spill(run, spill_id, 1);
+    lk.lock();
+    if (!(spilled)) {
+      note_spill_error(spill_id);
+    }
+  }
+  // n_reads follows the sample, not the reads scanned.
+  void merge_sampled(const vector<uint64_t> &kmt, const vector<uint64_t> &sampled) {
+    unique_lock<mutex> lk(mtx);
+    uint64_t i = 0;
+    for (uint64_t f = 0; f < sampled.size(); f += 2) {
+      sample_hashes.push_back(sampled[f]);
+      for (uint64_t end = i + sampled[f + 1]; i < end; ++i) {
+        sample_matches.push_back(make_pair(sampled[f], kmt[i]));
+      }
+    }
+    assert(i == kmt.size());
+    if (sample_hashes.size() >= 2 * p_subsample->count) {
+      prune_sample();
+    }
+    ++n_processed_chunks;
+    n_reads = sample_hashes.size() * sample_reads_per_fragment;
+  }
+  // Called with mtx held, or after all chunks are merged.  Keep the fragments with the count
+  // smallest hashes, and all that tie with the largest of those, so the sample does not depend on
+  // the order chunks were merged in.
+  void prune_sample() {
+    if (sample_hashes.size() <= p_subsample->count) {
+      return;
+    }
+    nth_element(sample_hashes.begin(), sample_hashes.begin() + (p_subsample->count - 1), sample_hashes.end());
+    const uint64_t limit = sample_hashes[p_subsample->count - 1];
+    sample_hashes.erase(remove_if(sample_hashes.begin(), sample_hashes.end(), [&](uint64_t h) { return h > limit; }),
+                        sample_hashes.end());
+    sample_matches.erase(remove_if(sample_matches.begin(), sample_matches.end(),
+                                   [&](const pair<uint64_t, uint64_t> &m) { return m.first > limit; }),
+                         sample_matches.end());
+    sample_limit = limit;
+  }
+  // Called with mtx held.  Tells the reader to stop once a target of the StopPlan is met.
+  void check_saturation() {
+    ostringstream reason;
+    if (p_stop->coverage > 0 && distinct_snps > 0) {
+      bool met = true;
+      for (uint32_t sp = 0; met && sp < species_snps.size(); ++sp) {
+        met = species_hits[sp] >= p_stop->coverage * species_snps[sp];
+      }
+      if (met) {
+        reason << "every species found reached mean coverage " << p_stop->coverage;
+      }
+    }
+    if (reason.tellp() == 0 && n_reads - block_start_reads >= StopPlan::BLOCK_READS) {
+      const double rate = (distinct_snps - block_start_snps) * 1e6 / (n_reads - block_start_reads);
+      if (rate < p_stop->new_snps_per_million) {
+        reason << "only " << rate << " new SNPs per million reads";
+      }
+      block_start_reads = n_reads;
+      block_start_snps = distinct_snps;
+    }
+    if (reason.tellp() == 0) {
+      return;
+    }
+    saturated = true;
+    unique_lock<mutex> lk(*p_print_lock);
+    cerr << chrono_time() << ":  [Info] Genotypes saturated for " << in_path << " after " << n_reads
+         << " reads:  " << reason.str() << ";  reading no further." << endl;
+  }
+  void schedule_snapshot() {
+    if (p_snapshots->every_reads) {
+      next_snapshot_reads = n_reads + p_snapshots->every_reads;
+    }
+    if (p_snapshots->every_secs > 0) {
+      next_snapshot_us = steady_time_us() + long(p_snapshots->every_secs * 1e6);
+    }
+  }
+  // Called with mtx held in lk, which it releases.  Takes the counters, copied, or swapped for
+  // zeroed ones for delta snapshots, then writes the nonzero ones to stdout after a header line
+  // without holding mtx, so chunks go on merging meanwhile.  Holding snapshot_mtx from before mtx
+  // is released keeps the snapshots in order, and snapshot_counts zeroed between delta snapshots.
+  void write_snapshot(unique_lock<mutex> &lk, const bool final) {
+    unique_lock<mutex> write_lk(snapshot_mtx);
+    auto &counts = *p_dense_counts;
+    const bool delta = p_snapshots->delta;
+    snapshot_counts.resize(counts.size());
+    if (delta) {
+      counts.swap(snapshot_counts);
+    } else {
+      copy(counts.begin(), counts.end(), snapshot_counts.begin());
+    }
+    const auto snapshot = n_snapshots++;
+    const uint64_t reads = n_reads;
+    const double seconds = (steady_time_us() - stream_start_us) / 1e6;
+    wrote_final_snapshot = final;
+    schedule_snapshot();
+    lk.unlock();
+    const auto &ids = p_dense->ids();
+    fprintf(stdout, "# snapshot=%d reads=%" PRIu64 " seconds=%.1f counts=%s final=%d\n", snapshot, reads, seconds,
+            delta ? "delta" : "cumulative", int(final));
+    uint64_t n_hits = 0;
+    uint64_t snapshot_snps = 0;
+    for (uint64_t i = 0; i < ids.size(); ++i) {
+      if (snapshot_counts[i] == 0) {
+        continue;
+      }
+      ++snapshot_snps;
+      n_hits += snapshot_counts[i];
+      fprintf(stdout, "%" PRId64 "\t%" PRId64 "\n", ids[i], uint64_t(snapshot_counts[i]));
+      if (delta) {
+        snapshot_counts[i] = 0;
+      }
+    }
+    fflush(stdout);
+    if (ferror(stdout)) {
+      output_error = true;
+    }
+    {
+      unique_lock<mutex> print_lk(*p_print_lock);
+      cerr << chrono_time() << ":  [Snapshot] " << snapshot << ":  " << snapshot_snps << " snps, " << n_hits
+           << " hits after " << reads << " reads" << (final ? ", final." : ".") << endl;
+    }
+  }
+  // Called with mtx held.
+  void switch_to_dense_counters() {
+    {
+      unique_lock<mutex> lk(*p_print_lock);
+      cerr << chrono_time() << ":  [Info] Matches for " << in_path
+           << " outgrew their buffer;  switching to dense counters." << endl;
+    }
+    p_dense_counts = new vector<uint32_t>(p_dense->ids().size());
+    p_dense->rank(*p_kmer_matches);
+    for (const auto rank : *p_kmer_matches) {
+      ++(*p_dense_counts)[rank];
+    }
+    delete p_kmer_matches;
+    p_kmer_matches = NULL;
+    dense = true;
+  }
 };
 
+void write_perf_report(const string &path, const PerfCounters &pc, const vector<Result *> &results, const int n_threads,
+                       const int M2, const int M3, const long elapsed_ms) {
+  // One JSON object with run-wide totals followed by a per-input breakdown.  Times are in
+  // microseconds of thread time, summed over all threads, except where noted.
+  ostringstream json;
+  const auto ratio = [](const double num, const double den) { return den ? num / den : 0.0; };
+  json << "{\n"
+       << "  \"elapsed_ms\": " << elapsed_ms << ",\n"
+       << "  \"threads\": " << n_threads << ",\n"
+       << "  \"l\": " << (K2 - M2) << ",\n"
+       << "  \"m\": " << M3 << ",\n"
+       << "  \"query\": {\"segments\": " << pc.segments << ", \"kmers\": " << pc.kmers
+       << ", \"bloom_passes\": " << pc.bloom_passes
+       << ", \"bloom_hit_rate\": " << ratio(pc.bloom_passes, pc.kmers) << ", \"lmer_probes\": " << pc.lmer_probes
+       << ", \"avg_bucket_length\": " << ratio(pc.bucket_entries, pc.lmer_probes) << ", \"matches\": " << pc.matches
+       << ", \"snp_hits\": " << pc.snp_hits << ", \"query_us\": " << pc.query_us
+       << ", \"ns_per_kmer\": " << ratio(pc.query_us * 1000, pc.kmers) << "},\n"
+       << "  \"input\": {\"bytes_decompressed\": " << pc.bytes_read << ", \"read_us\": " << pc.read_us
+       << ", \"segment_wait_us\": " << pc.segment_wait_us << "},\n"
+       << "  \"scheduler\": {\"queue_wait_us\": " << pc.queue_wait_us << "},\n"
+       << "  \"output\": {\"output_us\": " << pc.output_us << "},\n";
+  if (pc.hw_requested) {
+    json << "  \"perf_events\": {\"available\": " << (pc.hw_enabled ? "true" : "false") << ", \"query\": {";
+    for (int e = 0; e < N_HW_EVENTS; ++e) {
+      json << (e ? ", " : "") << "\"" << hw_event_names[e] << "\": ";
+      if (pc.hw_event_available[e]) {
+        json << pc.hw_query_events[e];
+      } else {
+        json << "null";
+      }
+    }
+    json << "}, \"kernel_stages_approximate\": true, \"stages\": {";
+    for (int stage = 0; stage < N_STAGES; ++stage) {
+      json << (stage ? ", " : "") << "\"" << stage_names[stage] << "\": {";
+      for (int e = 0; e < N_HW_EVENTS; ++e) {
+        json << (e ? ", " : "") << "\"" << hw_event_names[e] << "\": ";
+        if (pc.hw_event_available[e]) {
+          json << pc.hw_events[stage][e];
+        } else {
+          json << "null";
+        }
+      }
+      json << ", \"ipc\": " << ratio(pc.hw_events[stage][HW_INSTRUCTIONS], pc.hw_events[stage][HW_CYCLES]) << "}";
+    }
+    json << "}},\n";
+  }
+  json << "  \"files\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto &r = *results[i];
+    json << (i ? ",\n" : "\n") << "    {\"input\": \"" << regex_replace(r.in_path, regex("([\"\\\\])"), "\\$1")
+         << "\", \"skipped\": " << (r.skip ? "true" : "false") << ", \"error\": " << (r.error ? "true" : "false")
+         << ", \"bytes_decompressed\": " << r.chars_read << ", \"reads\": " << r.n_reads << ", \"snps\": " << r.n_snps
+         << ", \"dense_counters\": " << (r.dense ? "true" : "false")
+         << ", \"stopped_early\": " << (r.saturated ? "true" : "false") << ", \"sort_us\": " << r.sort_us
+         << ", \"output_us\": " << r.output_us << "}";
+  }
+  json << "\n  ]\n}\n";
+  if (path == "-") {
+    cerr << json.str();
+  } else {
+    ofstream fh(path, ofstream::out | ofstream::binary);
+    fh << json.str();
+    if (!(fh)) {
+      cerr << chrono_time() << ":  [ERROR] Failed to write counters report " << path << endl;
+    }
+  }
+}
+
+// Pass a non-empty counters_path to collect hot path counters and per-stage timings, and
+// write them as JSON to that path ("-" for stderr).  With hw_counters, the report also
+// attributes hardware events to pipeline stages.  Pass a plan to bound memory use under --max-ram.
+// With paired, each SNP is counted at most once per fragment:  mates come from the R2 files in
+// mate_paths, one for each input, or else alternate within each input (interleaved FASTQ).
+// Pass enabled snapshots to write counts from stdin to stdout while it streams, not only at EOF.
+// Pass an enabled stop plan to stop reading each input once its genotypes saturate, and an
+// enabled subsample to count only the fragments it samples.  Outputs are written in out_format,
+// annotated from dict for OUT_ANNOTATED, or else all go to the one matrix at cohort_path.  With a
+// spill_dir, matches past the buffer limit (the plan's, or SPILL_BUFFER_BYTES) spill to runs there.
 bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_index, uint64_t *snps, int n_inputs,
                  const char **input_paths, char *o_name, const int M2, const int M3, const int n_threads, const string &dbbase,
-                 const bool force, const string &c_prefix) {
+                 const bool force, const string &c_prefix, const string &counters_path = "", const bool hw_counters = false,
+                 const MemoryPlan *plan = NULL, const uint64_t snps_count = 0, const bool paired = false,
+                 const char **mate_paths = NULL, const SnapshotPlan *snapshots = NULL, const StopPlan *stop = NULL,
+                 const Subsample *subsample = NULL, const OutputFormat out_format = OUT_TSV,
+                 const BinaryDict *dict = NULL, const string &cohort_path = "", const string &spill_dir = "") {
 
   auto s_start = chrono_time();
   const char *stdin = "/dev/stdin";
+  const bool streaming = n_inputs == 0 || input_paths == NULL || o_name == NULL;
 
-  if (n_inputs == 0 || input_paths == NULL || o_name == NULL) {
+  if (streaming) {
     cerr << chrono_time() << ":  [Info] Will input reads from stdin and output snps to stdout." << endl;
-    cerr << chrono_time() << ":  [Info] Output will appear only after stdin reaches EOF." << endl;
+    if (snapshots && snapshots->enabled()) {
+      cerr << chrono_time() << ":  [Info] Snapshots of the counts will appear as reads stream in." << endl;
+    } else {
+      cerr << chrono_time() << ":  [Info] Output will appear only after stdin reaches EOF." << endl;
+    }
     n_inputs = 1;
     input_paths = &stdin;
     o_name = NULL;
@@ -1113,16 +3465,81 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
   uint64_t total_reads = 0;
   mutex print_lock;
 
+  unique_ptr<CohortMatrix> cohort;
+  if (!(cohort_path.empty())) {
+    cohort.reset(new CohortMatrix(cohort_path, n_inputs));
+    if (!(cohort->open())) {
+      cerr << chrono_time() << ":  [ERROR] Failed to create " << cohort->tmp_path << endl;
+      return true;
+    }
+  }
+
   vector<Result *> results;
   for (int i = 0; i < n_inputs; ++i) {
     // This deletes any pre-existing output file and emits out.i.err if
     // the required decompressor for input_paths[i] is not installed.
-    results.push_back(new Result(i, input_paths[i], o_name, dbbase, force, &print_lock, c_prefix));
+    results.push_back(
+        new Result(i, input_paths[i], o_name, dbbase, force, &print_lock, c_prefix, mate_paths ? mate_paths[i] : NULL,
+                   out_format, dict, cohort.get()));
+  }
+
+  DenseSnpIndex dense_index(snps, snps_count);
+  if (plan) {
+    assert(snps_count > 0);
+    for (auto r : results) {
+      r->limit_match_buffer(&dense_index, plan->match_buffer_bytes);
+    }
+  }
+  if (!(spill_dir.empty())) {
+    for (auto r : results) {
+      r->spill_to(spill_dir, plan ? plan->match_buffer_bytes : SPILL_BUFFER_BYTES);
+    }
+  }
+  if (streaming && snapshots && snapshots->enabled() && !(results[0]->skip) && !(results[0]->error)) {
+    assert(snps_count > 0);
+    results[0]->stream_snapshots(&dense_index, snapshots);
+  }
+  if (subsample && subsample->enabled()) {
+    for (auto r : results) {
+      r->subsample(subsample, paired ? 2 : 1);
+    }
+  } else {
+    subsample = NULL;
+  }
+  if (stop && stop->enabled()) {
+    assert(snps_count > 0);
+    for (auto r : results) {
+      if (!(r->skip) && !(r->error)) {
+        r->stop_when_saturated(&dense_index, stop);
+      }
+    }
   }
 
-  SegmentContext sc(n_threads);
+  PerfCounters perf_counters;
+  PerfCounters *counters = counters_path.empty() ? NULL : &perf_counters;
+  if (counters && hw_counters) {
+    counters->enable_hw_events();
+    if (counters->hw_enabled) {
+      cerr << chrono_time() << ":  [Info] Counting hardware events per stage;  each segment is scanned "
+           << (STAGE_CANDIDATE_VERIFY + 1) << " times to isolate stages." << endl;
+      for (auto r : results) {
+        r->measure_sort_events = true;
+      }
+    } else {
+      cerr << chrono_time() << ":  [WARNING] Hardware event counters are unavailable on this system;  "
+           << "check /proc/sys/kernel/perf_event_paranoid.  Reporting software counters only." << endl;
+    }
+  }
 
-  using QueryTask = tuple<int, int, uint64_t, uint64_t>;
+  ReadersContext rc(min(n_inputs, plan ? plan->n_readers : ReadersContext::default_readers()));
+  SegmentContext sc(n_threads, rc.MAX_PARALLEL_READERS, counters);
+
+  const int reads_per_fragment = paired ? 2 : 1;
+
+  // channel, segment_idx, segment_size, offset_in_file, enqueue time (steady_time_us), oversized.
+  // A record too large for one segment is gathered in a buffer of its own, which the task holds
+  // as oversized instead of a segment;  segment_idx is -1 then.
+  using QueryTask = tuple<int, int, uint64_t, uint64_t, long, shared_ptr<vector<char>>>;
   queue<QueryTask> query_tasks;
   mutex queue_mtx;
   condition_variable queue_cv;
@@ -1143,18 +3560,61 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
     int segment_idx;
     uint64_t segment_size;
     uint64_t offset_in_file;
-    tie(channel, segment_idx, segment_size, offset_in_file) = qt;
+    long t_enqueued;
+    shared_ptr<vector<char>> oversized;
+    tie(channel, segment_idx, segment_size, offset_in_file, t_enqueued, oversized) = qt;
     int64_t n_reads;
     {
       vector<uint64_t> kmt;
-      n_reads = kmer_lookup_chunk(&kmt, lmer_index, mmer_bloom, kmers_index, snps, sc.buffer_addr + SEGMENT_SIZE * segment_idx,
-                                  segment_size, M2, M3, results[channel]->in_path, s_start);
-      sc.release_segment(segment_idx, 1);
+      vector<uint64_t> sampled;
+      const uint64_t sample_limit = results[channel]->sample_limit;
+      QueryCounters qc;
+      const char *window = oversized ? oversized->data() : sc.buffer_addr + SEGMENT_SIZE * segment_idx;
+      const bool hw = counters && counters->hw_enabled;
+      PerfEventGroup events(hw);
+      uint64_t previous[N_HW_EVENTS];
+      uint64_t cumulative[N_HW_EVENTS];
+      if (hw) {
+        // Attribute hardware events to kernel stages by difference:  run the kernel over the
+        // segment once per stage, each pass stopping one stage later than the one before.
+        // Only the final, complete pass below produces matches or counts toward query time.
+        for (int stage = STAGE_PARSE; stage < STAGE_CANDIDATE_VERIFY; ++stage) {
+          vector<uint64_t> discarded;
+          QueryCounters truncated(stage);
+          events.start();
+          kmer_lookup_chunk(&discarded, lmer_index, mmer_bloom, kmers_index, snps, window, segment_size, M2, M3,
+                            results[channel]->in_path, s_start, &truncated, reads_per_fragment, results[channel]->format,
+                            sample_limit);
+          events.stop(cumulative);
+          counters->add_stage_events(stage, cumulative, stage == STAGE_PARSE ? NULL : previous);
+          copy(cumulative, cumulative + N_HW_EVENTS, previous);
+        }
+        events.start();
+      }
+      const auto t_start = counters ? steady_time_us() : 0;
+      const bool sample_count = subsample && subsample->count;
+      n_reads = kmer_lookup_chunk(&kmt, lmer_index, mmer_bloom, kmers_index, snps, window, segment_size, M2, M3,
+                                  results[channel]->in_path, s_start, counters ? &qc : NULL, reads_per_fragment,
+                                  results[channel]->format, sample_limit, sample_count ? &sampled : NULL);
+      const auto t_end = counters ? steady_time_us() : 0;
+      if (hw) {
+        events.stop(cumulative);
+        counters->add_stage_events(STAGE_CANDIDATE_VERIFY, cumulative, previous);
+        counters->add_query_events(cumulative);
+      }
+      if (oversized) {
+        oversized.reset();
+      } else {
+        sc.release_segment(segment_idx, 1);
+      }
+      if (counters) {
+        counters->add_query(qc, kmt.size(), t_start - t_enqueued, t_end - t_start);
+      }
       if (n_reads < 0) {
         // if negative, n_reads isn't actually a count of reads;  it's a count of chars before the error
         results[channel]->data_format_error(offset_in_file - n_reads);
       }
-      results[channel]->merge_kmer_matches(kmt, n_reads);
+      results[channel]->merge_kmer_matches(kmt, n_reads, sample_count && n_reads >= 0 ? &sampled : NULL);
     }
     {
       unique_lock<mutex> lk(queue_mtx);
@@ -1170,19 +3630,43 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
   };
 
   int closed_outputs = 0;
+  // Output writers still running, including those that gave back their slot in running_threads.
+  int writing_outputs = 0;
 
   // this function will output result for an input file
   auto write_output_func = [&](const int result_idx) {
     auto &r = *results[result_idx];
-    r.write_output();
-    {
+    const auto t_start = steady_time_us();
+    // The thread gives back its slots once the output is sorted, as from then on it mostly waits
+    // on the compressor, which has threads of its own;  queries and other outputs go on meanwhile.
+    bool released = false;
+    auto release_slot = [&]() {
       unique_lock<mutex> lk(queue_mtx);
-      ++closed_outputs;
-      --running_threads;
-      if (running_threads == 0 || running_threads == n_threads - 1) {
+      if (!(released)) {
+        released = true;
+        running_threads -= r.sort_threads;
         lk.unlock();
         queue_cv.notify_one();
       }
+    };
+    r.write_output(release_slot);
+    r.output_us = steady_time_us() - t_start;
+    if (counters) {
+      counters->output_us += r.output_us;
+      if (counters->hw_enabled) {
+        counters->add_stage_events(STAGE_OUTPUT_SORT, r.sort_events);
+      }
+    }
+    {
+      unique_lock<mutex> lk(queue_mtx);
+      ++closed_outputs;
+      --writing_outputs;
+      if (!(released)) {
+        released = true;
+        running_threads -= r.sort_threads;
+      }
+      lk.unlock();
+      queue_cv.notify_one();
     }
   };
 
@@ -1225,7 +3709,11 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
           auto &r = *results[pending_output_result_idx];
           r.done_with_output = true;
           if (!(r.skip)) {
-            ++running_threads;
+            // Besides its own slot, the writer takes those free that no queued query waits for, to
+            // sort with;  they count in running_threads until it is sorted.
+            r.sort_threads = max<int>(1, n_threads - running_threads - int(query_tasks.size()));
+            running_threads += r.sort_threads;
+            ++writing_outputs;
             thread(write_output_func, pending_output_result_idx).detach();
           }
           while (first_result_idx_not_done_with_output < n_inputs &&
@@ -1242,7 +3730,7 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
           thread(query_task_func, task).detach();
           query_tasks.pop();
         }
-        all_done = (running_threads == 0) && query_tasks.empty() && all_inputs_scanned &&
+        all_done = (running_threads == 0) && (writing_outputs == 0) && query_tasks.empty() && all_inputs_scanned &&
                    (first_result_idx_not_done_with_output == n_inputs);
         // cerr << running_threads << " " << query_tasks.size() << " " << all_inputs_scanned << " " <<
         // first_result_idx_not_done_with_output << endl;
@@ -1251,8 +3739,6 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
     } while (!(all_done));
   };
 
-  ReadersContext rc;
-
   auto done_with_input = [&](const int channel) {
     unique_lock<mutex> lk(queue_mtx);
     results[channel]->finished_reading = true;
@@ -1272,31 +3758,113 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
     }
     uint64_t offset_in_file = 0;
     r->open_input();
-    while (!(r->error)) {
-      segment.advance(r->input_file, channel);
-      if (ferror(r->input_file)) {
+    if (r->format == FORMAT_BAM && !(r->error)) {
+      // Segments hold BAM records, so the reader consumes the header first.
+      if (!(skip_bam_header(r->input_file, offset_in_file))) {
+        r->data_format_error();
+      }
+      r->chars_read = offset_in_file;
+    }
+    unique_ptr<MateReader> mates(r->mate_file ? new MateReader(r->input_file, r->mate_file) : NULL);
+    // Set while gathering a record that does not fit in one segment.
+    shared_ptr<vector<char>> oversized;
+    unique_ptr<RecordSplitter> splitter;
+    // While streaming snapshots, hand on whatever has arrived instead of waiting for a full segment.
+    const bool streaming = r->p_snapshots != NULL;
+    bool read_failed = false;
+    uint64_t bytes_read = 0;
+    // Once genotypes saturate, queue no more segments;  those already queued are still counted.
+    while (!(r->error) && !(r->saturated)) {
+      if (mates) {
+        bytes_read = segment.advance_with(
+            [&](char *dst, const uint64_t capacity) { return mates->read_pairs(dst, capacity); });
+      } else if (streaming) {
+        bytes_read = segment.advance_with([&](char *dst, const uint64_t capacity) {
+          return read_available(r->input_file, dst, capacity, r->p_snapshots->max_latency_ms(), read_failed);
+        });
+      } else {
+        bytes_read = segment.advance(r->input_file, channel);
+      }
+      r->chars_read += bytes_read;
+      if (read_failed || r->input_failed()) {
         r->note_io_error();
         break;
       }
-      if (segment.size == 0) {
+      if (mates && mates->error) {
+        r->data_format_error();
+        break;
+      }
+      if (segment.size == 0 && !(oversized)) {
         break;
       }
-      if (segment.size == SEGMENT_SIZE) {
-        // If we've filled the segment's entire buffer, it's likely that the segment
-        // ends in the middle of a fastq read.  Reverse to the start of that read.
-        segment.end_addr = last_read(segment.start_addr, segment.size);
-        if (segment.end_addr == NULL || segment.end_addr[0] != '@') {
+      if (r->format == FORMAT_UNKNOWN) {
+        r->format = mates ? mates->format : detect_format(segment.start_addr, segment.size);
+        if (r->format == FORMAT_UNKNOWN) {
           r->data_format_error();
           break;
         }
-        // Re-establish segment data invariant
-        segment.bytes_leftover = segment.size - (segment.end_addr - segment.start_addr);
+      }
+      const bool at_eof = streaming ? (bytes_read == 0) : (segment.size < SEGMENT_SIZE);
+      if (!(at_eof) && !(mates) && !(oversized)) {
+        // If we've filled the segment's entire buffer, it's likely that the segment
+        // ends in the middle of a record.  Reverse to the end of the last whole record
+        // (or fragment, for interleaved mates).
+        splitter.reset(new RecordSplitter(r->format, reads_per_fragment));
+        splitter->scan(segment.start_addr, segment.size);
+        if (splitter->malformed) {
+          r->data_format_error(offset_in_file + splitter->line_start);
+          break;
+        }
+        if (splitter->last_end == 0 && segment.size < SEGMENT_SIZE) {
+          // Streaming, and no whole record has arrived yet.  Keep it all for the next segment.
+          segment.end_addr = segment.start_addr;
+          segment.bytes_leftover = segment.size;
+          segment.assert_invariant();
+          continue;
+        }
+        if (splitter->last_end == 0) {
+          // The first record does not fit in a segment.  Gather it, and whatever follows it in
+          // the segments it spans, in a buffer of its own.
+          oversized.reset(new vector<char>());
+        } else {
+          segment.end_addr = segment.start_addr + splitter->last_end;
+          // Re-establish segment data invariant
+          segment.bytes_leftover = segment.size - splitter->last_end;
+          segment.assert_invariant();
+        }
+      }
+      if (oversized) {
+        oversized->insert(oversized->end(), segment.start_addr, segment.start_addr + segment.size);
+        splitter->scan(oversized->data(), oversized->size());
+        if (splitter->malformed) {
+          r->data_format_error(offset_in_file + splitter->line_start);
+          break;
+        }
+        // Keep the segment's bytes only as the leftover, if any, for the next segment.
+        segment.end_addr = segment.start_addr + segment.size;
+        segment.bytes_leftover = 0;
+        if (!(at_eof) && splitter->last_end == 0) {
+          continue;
+        }
+        const uint64_t task_size = at_eof ? oversized->size() : splitter->last_end;
+        // Records before the one that ends last_end were all wholly found in earlier segments,
+        // so the rest lies within this one.
+        assert(oversized->size() - task_size <= segment.size);
+        segment.bytes_leftover = oversized->size() - task_size;
+        segment.end_addr = segment.start_addr + segment.size - segment.bytes_leftover;
         segment.assert_invariant();
+        oversized->resize(task_size);
+        r->n_input_chunks++;
+        enqueue_query_task(QueryTask(channel, -1, task_size, offset_in_file, steady_time_us(), oversized));
+        offset_in_file += task_size;
+        oversized.reset();
+        continue;
       }
       // transfer 1 reservation to the task, to be released when the task completes
       --segment.tokens;
       r->n_input_chunks++;
-      enqueue_query_task(QueryTask(channel, segment.idx, segment.end_addr - segment.start_addr, offset_in_file));
+      enqueue_query_task(QueryTask(channel, segment.idx, segment.end_addr - segment.start_addr, offset_in_file,
+                                   steady_time_us(), shared_ptr<vector<char>>()));
       offset_in_file +=
           segment.end_addr - segment.start_addr; // only used for error reporting: number of bytes preceding segment
     }
@@ -1329,16 +3897,44 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
     }
   };
 
+  // A stalled stream still gets its --snapshot-secs snapshots.
+  mutex timer_mtx;
+  condition_variable timer_cv;
+  bool timer_done = false;
+  thread snapshot_timer;
+  if (streaming && results[0]->p_snapshots && snapshots->every_secs > 0) {
+    snapshot_timer = thread([&] {
+      unique_lock<mutex> lk(timer_mtx);
+      while (!(timer_cv.wait_for(lk, chrono::milliseconds(snapshots->max_latency_ms()), [&] { return timer_done; }))) {
+        results[0]->snapshot_if_due();
+      }
+    });
+  }
+
   thread(input_scan_loop).detach();
   task_dispatch_loop();
 
+  if (snapshot_timer.joinable()) {
+    {
+      unique_lock<mutex> lk(timer_mtx);
+      timer_done = true;
+    }
+    timer_cv.notify_one();
+    snapshot_timer.join();
+  }
+
   cerr << chrono_time() << ":  " << (total_reads / 10000) / 100.0 << " million reads were scanned after "
        << (chrono_time() - s_start) / 1000 << " seconds" << endl;
   int files_with_errors = 0;
   int files_without_errors = 0;
   int skipped_files = 0;
   uint64_t reads_covered = 0;
+  if (counters) {
+    write_perf_report(counters_path, *counters, results, n_threads, M2, M3, chrono_time() - s_start);
+  }
+  vector<string> names;
   for (int i = 0; i < n_inputs; ++i) {
+    names.push_back(results[i]->in_path);
     if (results[i]->skip) {
       ++skipped_files;
     } else if (results[i]->error || results[i]->output_error) {
@@ -1361,6 +3957,17 @@ bool kmer_lookup(LmerRange *lmer_index, uint64_t *mmer_bloom, uint32_t *kmers_in
   if (files_with_errors) {
     cerr << "*** Failed for " << (files_without_errors == 0 ? "ALL " : "") << files_with_errors << " input files. ***" << endl;
   }
+  if (cohort) {
+    // A matrix missing some columns would silently pass for zero counts.
+    if (files_with_errors) {
+      cerr << chrono_time() << ":  [ERROR] Not writing " << cohort_path << " as some inputs failed." << endl;
+    } else if (!(cohort->finish(names))) {
+      cerr << chrono_time() << ":  [ERROR] Failed to write " << cohort_path << endl;
+      return true;
+    } else {
+      cerr << chrono_time() << ":  Done writing the counts of " << n_inputs << " inputs to " << cohort_path << endl;
+    }
+  }
   return (files_with_errors > 0);
 }
 
@@ -1378,22 +3985,124 @@ void display_usage(char *fname) {
        << "  -h <display this usage info>\n"
        << "  -f <force overwrite of pre-existing outputs>\n"
        << "  -C <in_prefix; string; default: none>\n"
+       << "  --counters <path; write hot path counters and per-stage timings as JSON; '-' for stderr>\n"
+       << "  --perf-counters <add per-stage hardware event counts to the --counters report; Linux only>\n"
+       << "  --tune <benchmark -l, -m and -t on this machine, save the choice next to the DB, then run>\n"
+       << "  --tune-ram <RAM budget in GB for --tune; default --max-ram, or 90% of system RAM>\n"
+       << "  --max-ram <RAM budget in GB for the whole run; default: unlimited>\n"
+       << "  --match-buffer-mb <MB of matches each input buffers before dense counters or --spill-dir>\n"
+       << "  --paired <inputs are R1 R2 file pairs; count each SNP at most once per fragment>\n"
+       << "  --interleaved <each input holds mates interleaved R1, R2, R1, R2, ...; as --paired>\n"
+       << "  --snapshot-reads <write counts so far to stdout every N reads from stdin>\n"
+       << "  --snapshot-secs <write counts so far to stdout every T seconds while reading stdin>\n"
+       << "  --snapshot-delta <snapshots hold counts since the previous snapshot, not cumulative>\n"
+       << "  --stop-coverage <stop reading an input once each species found has this mean coverage>\n"
+       << "  --stop-new-snps <stop reading an input once a million reads find fewer new SNPs than this>\n"
+       << "  --subsample <count only this fraction (0..1) of reads, or this many reads (1 or more)>\n"
+       << "  --species <genotype only these species;  ids separated by commas>\n"
+       << "  --species-file <genotype only the species listed in this file;  as --species>\n"
+       << "  --prescreen <genotype only the species found in reads sampled from the inputs>\n"
+       << "  --out-format <tsv or binary;  default tsv>\n"
+       << "  --dict <binary SNP dictionary from gt_pro dict;  writes annotated output>\n"
+       << "  --cohort <path of one count matrix to write for all inputs, instead of an output each>\n"
+       << "  --spill-dir <directory for sorted runs of matches that outgrow memory, merged at output>\n"
        << "  [input0, input1, ...]\n"
        << "\n"
        << "WHERE\n"
        << "\n"
-       << "  input1, input2, ... are files in FASTQ format, optionally compressed,\n"
-       << "  and optionally in the dir specified by -C, which may be an s3 bucket\n"
+       << "  input1, input2, ... are files in FASTQ or FASTA format, optionally compressed,\n"
+       << "  and optionally in the dir specified by -C, which may be an s3 bucket;  sequences\n"
+       << "  (and FASTQ quality strings) may span multiple lines, and FASTA sequences such as\n"
+       << "  assembled contigs count as one read each;  reads have no length limit, and a record\n"
+       << "  too long for one 12 MB segment is gathered in a buffer of its own\n"
+       << "\n"
+       << "  inputs ending in .bam are read as (unaligned) BAM, decompressed with bgzip -@ 4 if\n"
+       << "  installed, else pigz or gzip;  secondary and supplementary records are skipped, and\n"
+       << "  output is gzip compressed\n"
        << "\n"
-       << "  when no inputs are specified, gt_pro consumes fastq input from stdin\n"
+       << "  when no inputs are specified, gt_pro consumes fastq or fasta input from stdin\n"
        << "  until stdin reaches EOF, then emits all output to stdout at once\n"
        << "\n"
+       << "  with --snapshot-reads or --snapshot-secs, stdin is processed as it arrives, and each\n"
+       << "  snapshot is a line '# snapshot=<n> reads=<n> seconds=<t> counts=<cumulative|delta>\n"
+       << "  final=<0|1>' followed by '<snp id> <count>' lines for the nonzero counts;  counts are\n"
+       << "  kept in one counter per SNP, so memory stays fixed however long the stream runs, and\n"
+       << "  the last snapshot, final=1, is written at EOF\n"
+       << "\n"
        << "  in the optional -o output prefix, %{db} expands to the DB name,\n"
        << "  %{in} expands to the corresponding input base name, and %{n} expands\n"
        << "  to the corresponding input number 0, 1, 2, ..., if input != stdin\n"
        << "\n"
        << "  -f causes any pre-existing output files to be overwritten\n"
        << "\n"
+       << "  --out-format binary writes <out_prefix>.gtpb, uncompressed, instead of .tsv:  SNP ids are\n"
+       << "  delta encoded and counts varint encoded, in a fraction of the space and time of text;\n"
+       << "  'gt_pro view <file.gtpb>' prints one as TSV\n"
+       << "\n"
+       << "  --dict <snp_dict.gtpd>, made once by 'gt_pro dict <snp_dict.tsv>', writes the table of\n"
+       << "  'gt_pro parse' instead:  for each SNP site with hits, its fields from the dictionary and\n"
+       << "  the counts of both alleles;  sites not in the dictionary are left out\n"
+       << "\n"
+       << "  --cohort <cohort.gtpm> writes a sparse SNP by input matrix, with a column for each input\n"
+       << "  in the format of --out-format binary, in place of per-input outputs;  columns are added\n"
+       << "  as inputs finish, and 'gt_pro view <cohort.gtpm>' prints the matrix as TSV\n"
+       << "\n"
+       << "  --counters reports k-mers examined, bloom filter passes, lmer bucket lengths, matches,\n"
+       << "  bytes decompressed, time blocked waiting for segments and in the task queue, and\n"
+       << "  per-file sort and output times;  use it to tell whether a run is I/O or memory bound\n"
+       << "\n"
+       << "  --perf-counters counts cycles, instructions, LLC and dTLB misses with perf_event_open\n"
+       << "  and attributes them to the parse, bloom_probe, lmer_probe, candidate_verify and\n"
+       << "  output_sort stages;  kernel stages are isolated by rescanning each segment once per\n"
+       << "  stage, so expect the query phase to run about 4x slower in this mode;  the stages are\n"
+       << "  approximate differences between those passes, which may even be negative, and add up\n"
+       << "  to the \"query\" totals of the complete pass\n"
+       << "\n"
+       << "  --tune builds the lmer index and bloom filter for each candidate -l/-m that fits the\n"
+       << "  RAM budget, times queries on reads sampled from the first input, and saves the fastest\n"
+       << "  -l, -m and -t to <db>_optimized_db_tuning.tsv;  later runs without -l/-m use that file\n"
+       << "  instead of the built-in RAM table, and -t is taken from it unless given explicitly;  the\n"
+       << "  file records the path, size and time of the DB files, and is ignored once they change\n"
+       << "\n"
+       << "  --max-ram caps the RAM for DB, index, read buffers and matches;  a smaller -l/-m than\n"
+       << "  otherwise chosen, or fewer threads, are used to fit, and inputs with more matches than\n"
+       << "  fit are counted in one dense counter per SNP instead;  gt_pro exits with an error right\n"
+       << "  away if even the smallest configuration does not fit\n"
+       << "\n"
+       << "  --spill-dir <dir> bounds the matches each input holds in RAM, to its share of --max-ram\n"
+       << "  or else 1 GB:  past that, they are sorted into a run of counts in a file under <dir>,\n"
+       << "  in place of dense counters, and the runs are merged when the output is written;  the\n"
+       << "  files are removed once it is\n"
+       << "\n"
+       << "  --match-buffer-mb sets that bound per input directly, or lowers the one --max-ram gives;\n"
+       << "  without --spill-dir, matches past it are folded into dense counters, as under --max-ram\n"
+       << "\n"
+       << "  --stop-coverage and --stop-new-snps end an input early once its genotypes saturate:\n"
+       << "  when, in every species with SNPs found, the hits reach the given mean per SNP found, or\n"
+       << "  when a block of a million reads finds fewer previously unseen SNPs than given;  either\n"
+       << "  target suffices, and the [Done] message and --counters report show the reads consumed\n"
+       << "\n"
+       << "  --species restricts the DB to the SNPs of the given 6 digit species ids, and caches that\n"
+       << "  sub-DB next to the DB as <db>_species_<n>_<hash>_optimized_db_*.bin, with the DB and\n"
+       << "  species it was derived from in <db>_species_<n>_<hash>_optimized_db_species.tsv;  it is\n"
+       << "  rebuilt if either differs.  The sub-DB gets a smaller -l/-m to suit its size unless given\n"
+       << "  explicitly, its own --tune file, and %{db} expands to its name\n"
+       << "\n"
+       << "  --prescreen first queries about 400k reads from the head of each input against a sketch\n"
+       << "  of the DB, 1 in 256 SNPs with all their k-mers, cached as <db>_optimized_db_prescreen_\n"
+       << "  sketch.bin;  species with at least 2 sketch SNPs hit are then genotyped as with --species,\n"
+       << "  but the sub-DB is built in memory and not cached;  species too rare to show up in the\n"
+       << "  samples are not genotyped\n"
+       << "\n"
+       << "  --subsample picks reads by a hash of their names, so the same reads are counted in every\n"
+       << "  run, whatever the thread count;  with --paired or --interleaved, mates are kept or dropped\n"
+       << "  together;  for a read count, the reads with the smallest hashes are kept, which needs\n"
+       << "  about 16 bytes per read and 16 per SNP hit for twice that many reads, beyond --max-ram\n"
+       << "\n"
+       << "  --paired and --interleaved make counts fragment based:  mates are read in lock-step,\n"
+       << "  and a SNP covered by both mates of a pair counts once;  with --paired, output and %{in}\n"
+       << "  are named after the R1 file, and %{n} numbers the pairs\n"
+       << "\n"
        << "USAGE EXAMPLES\n"
        << "\n"
        << "  The following two methods of running gtpro produce equivalent results.\n"
@@ -1413,6 +4122,31 @@ void display_usage(char *fname) {
        << "  with forced overwriting of existing outputs, use arguments -f -o out.%{n}\n";
 }
 
+// The number given to option, or else exit with usage, rather than let stod throw.
+double number_arg(const char *option, const char *arg, char *fname) {
+  char *end;
+  errno = 0;
+  const double value = strtod(arg, &end);
+  if (end == arg || *end != '\0' || errno || !(std::isfinite(value))) {
+    cerr << option << " takes a number, not '" << arg << "'\n";
+    errno = 0;
+    display_usage(fname);
+    exit(1);
+  }
+  return value;
+}
+
+// The same for a whole number, at least 0.
+uint64_t whole_number_arg(const char *option, const char *arg, char *fname) {
+  const double value = number_arg(option, arg, fname);
+  if (value < 0 || value != floor(value) || value >= 9e18) {
+    cerr << option << " takes a whole number, not '" << arg << "'\n";
+    display_usage(fname);
+    exit(1);
+  }
+  return uint64_t(value);
+}
+
 template <class ElementType> struct DBIndex {
 
   string filename;
@@ -1514,17 +4248,884 @@ private:
       }
     }
   }
-};
-
-struct SNPSeq {
-  uint64_t low_64;
-  uint64_t high_64;
-};
+};
+
+struct SNPSeq {
+  uint64_t low_64;
+  uint64_t high_64;
+};
+
+// Build the lmer index and/or the bloom filter for the geometry (K2 - M2, M3) from the kmer index.
+// Either output may be NULL, and both must be zero filled on entry.
+void build_lmer_index_and_bloom(LmerRange *lmer_index, uint64_t *mmer_bloom, const uint32_t *kmer_index,
+                                const uint64_t kmer_count, const uint64_t *snps, const uint64_t snps_count, const int M2,
+                                const int M3) {
+  const auto LMER_MASK = (LSB << (K2 - M2)) - LSB;
+  const auto MAX_BLOOM = (LSB << M3) - LSB;
+  const auto l_start = chrono_time();
+  auto t_last_progress_update = l_start;
+  uint64_t start = 0;
+  uint64_t last_lmer;
+  for (uint64_t end = 0; end < kmer_count; ++end) {
+    if (((end + 1) % (10 * 1000 * 1000)) == 0 && (chrono_time() - t_last_progress_update >= 10 * 1000)) {
+      // print progress update every 10 million kmers / but not more often than every 10 seconds
+      t_last_progress_update = chrono_time();
+      const auto t_elapsed = t_last_progress_update - l_start;
+      const auto fraction_complete = double(end + 1) / kmer_count;
+      const auto t_remaining = (t_elapsed / fraction_complete) * (1.0 - fraction_complete);
+      cerr << t_last_progress_update << ":  Processed almost " << ((end + 1) / (1000 * 1000)) << " million kmers ("
+           << int(fraction_complete * 1000) / 10.0 << " percent).  Expect to complete processing in "
+           << int(t_remaining / (60 * 100)) / 10.0 << " more minutes." << endl;
+    }
+    const auto kmi = kmer_index[end];
+    const auto offset = kmi & 0x1f;
+    const auto snp_id = kmi >> 5;
+    assert(0 <= offset && offset <= 31 && offset < K);
+    assert(0 <= snp_id && snp_id <= snps_count);
+    const auto *snp_repr = &(snps[3 * snp_id]);
+    const auto low_bits = snp_repr[0] >> (62 - (offset * BITS_PER_BASE));
+    const auto high_bits = (snp_repr[1] << (offset * BITS_PER_BASE)) & FULL_KMER;
+    assert(((snp_repr[0] >> 62) == (snp_repr[1] & 0x3)) && "SNP position differs in two supposedly redundant representations.");
+    auto kmer = high_bits | low_bits;
+    const auto kmer_rc = reverse_complement(kmer);
+    if (kmer_rc < kmer) {
+      // remember only the smaller of the kmer pair is in the DB, index, and bloom filter
+      kmer = kmer_rc;
+    }
+    const auto lmer = kmer >> M2;
+    if (lmer_index) {
+      if ((end > 0) && (lmer != last_lmer)) {
+        start = end;
+      }
+      // Invariant:  The data loaded so far for lmer reside at kmer_index[start...]
+      assert(start <= MAX_START);
+      const auto len = end - start + 1;
+      assert(len < MAX_LEN);
+      assert(lmer <= LMER_MASK);
+      lmer_index[lmer] = (start << LEN_BITS) | len;
+      last_lmer = lmer;
+    }
+    if (mmer_bloom) {
+      const uint64_t bloom_index = kmer & MAX_BLOOM;
+      mmer_bloom[bloom_index / 64] |= ((uint64_t)1) << (bloom_index % 64);
+    }
+  }
+}
+
+// Candidate geometries for --tune:  the pairs from the table in choose_optimal_l_and_m, plus
+// two smaller ones that suit small DBs.  Candidates that exceed the RAM budget are skipped.
+const int TUNE_CANDIDATES[][2] = {{24, 28}, {26, 30}, {28, 31}, {28, 33}, {29, 33}, {29, 34},
+                                  {29, 35}, {30, 35}, {30, 36}, {31, 36}, {32, 36}};
+
+// Bytes of RAM taken by the lmer index and bloom filter of a geometry.
+double index_bytes_for(const int L2, const int M3) { return double(LSB << L2) * sizeof(LmerRange) + double(LSB << M3) / 8; }
+
+// The smallest candidate geometry with about one lmer bucket and 16 bloom filter bits per k-mer,
+// for a DB much smaller than the full one, such as a --species sub-DB.  Never larger than l, m;
+// returns false, leaving them, if no smaller candidate fits the k-mer count.
+bool shrink_geometry(int &l, int &m, const uint64_t kmer_count) {
+  for (const auto &candidate : TUNE_CANDIDATES) {
+    const int cl = candidate[0];
+    const int cm = candidate[1];
+    if ((LSB << cl) >= kmer_count && (LSB << cm) >= 16 * kmer_count && index_bytes_for(cl, cm) < index_bytes_for(l, m)) {
+      l = cl;
+      m = cm;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Copy the virtual SNPs of the given species, and the k-mers that cover them, from an optimized DB
+// into a sub-DB.  SNP ids are renumbered;  the k-mers stay in the order of the full DB, which is
+// what build_lmer_index_and_bloom needs.
+void restrict_to_species(vector<uint64_t> &sub_snps, vector<uint32_t> &sub_kmer_index, const uint64_t *snps,
+                         const uint64_t snps_count, const uint32_t *kmer_index, const uint64_t kmer_count,
+                         const set<uint64_t> &species) {
+  const uint32_t NOT_KEPT = numeric_limits<uint32_t>::max();
+  vector<uint32_t> new_id(snps_count, NOT_KEPT);
+  for (uint64_t i = 0; i < snps_count; ++i) {
+    if (species.count(snp_species(snps[3 * i + 2] & SNP_MAX_REAL_ID))) {
+      new_id[i] = sub_snps.size() / 3;
+      sub_snps.insert(sub_snps.end(), snps + 3 * i, snps + 3 * i + 3);
+    }
+  }
+  for (uint64_t z = 0; z < kmer_count; ++z) {
+    const auto kmi = kmer_index[z];
+    const auto id = new_id[kmi >> 5];
+    if (id != NOT_KEPT) {
+      sub_kmer_index.push_back((id << 5) | (kmi & 0x1f));
+    }
+  }
+}
+
+// Parse species ids separated by commas or whitespace, as given to --species or in a --species-file.
+bool parse_species_list(const string &arg, set<uint64_t> &species) {
+  string text = arg;
+  replace(text.begin(), text.end(), ',', ' ');
+  istringstream words(text);
+  string word;
+  while (words >> word) {
+    if (word.size() > 6 || word.find_first_not_of("0123456789") != string::npos) {
+      return false;
+    }
+    species.insert(stoull(word));
+  }
+  return !(species.empty());
+}
+
+// Fit a run over n_inputs inputs into plan.budget_gb of RAM.  The budget must cover the mmapped
+// DB, the lmer index and bloom filter, the segment pool, and the matches of every input in flight;
+// those may be folded into dense counters (see DenseSnpIndex) so they need not grow without bound.
+// Each input in flight is charged one set of counters, which also covers the counters --stop-*
+// keeps for each input from when it is opened until its output is written.
+// Candidate geometries are tried in order at n_threads, then at successively fewer threads unless
+// fixed_threads.  Fills in the rest of the plan and returns true on success.
+bool plan_memory(MemoryPlan &plan, const vector<pair<int, int>> &candidates, const double db_bytes, const uint64_t snps_count,
+                 const int n_threads, const bool fixed_threads, const int n_inputs) {
+  const double budget_bytes = plan.budget_gb * (1ULL << 30);
+  const int n_readers = min(n_inputs, ReadersContext::default_readers());
+  // Leave each input room for at least one segment's worth of matches before folding.
+  const double min_buffer_bytes = SEGMENT_SIZE;
+  for (int t = n_threads; t >= 1; t = (t == 1 || fixed_threads) ? 0 : t / 2) {
+    const double pool_bytes = double(SegmentContext::segments_for(t, n_readers)) * SEGMENT_SIZE;
+    // Inputs are output promptly once scanned, so at most this many hold matches at once.
+    const int in_flight = min(n_inputs, n_readers + t);
+    for (const auto &candidate : candidates) {
+      const double rest = budget_bytes - db_bytes - index_bytes_for(candidate.first, candidate.second) - pool_bytes;
+      const double per_input = (rest - DenseSnpIndex::shared_bytes(snps_count)) / in_flight;
+      if (per_input - DenseSnpIndex::counters_bytes(snps_count) >= min_buffer_bytes) {
+        plan.l = candidate.first;
+        plan.m = candidate.second;
+        plan.n_threads = t;
+        plan.n_readers = n_readers;
+        plan.match_buffer_bytes = per_input - DenseSnpIndex::counters_bytes(snps_count);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Reads sampled from the head of the first input, to calibrate --tune.
+constexpr auto TUNE_SAMPLE_BYTES = 2 * SEGMENT_SIZE;
+
+// The configuration chosen by --tune.  It is persisted next to the DB, and used by later runs
+// that do not specify -l and -m (or -t) explicitly, as long as the DB files are unchanged.
+struct Tuning {
+  int l;
+  int m;
+  int threads;
+  double reads_per_sec;
+  double ram_budget_gb;
+  // The db_files_key of the DB tuned for.
+  string db;
+  Tuning() : l(0), m(0), threads(0), reads_per_sec(0.0), ram_budget_gb(0.0) {}
+  // False if the file is malformed, or holds a geometry that --tune does not choose from.
+  bool load(const string &path) {
+    ifstream fh(path);
+    string line;
+    while (getline(fh, line)) {
+      const auto tab = line.find('\t');
+      if (line.empty() || line[0] == '#' || tab == string::npos) {
+        continue;
+      }
+      const auto key = line.substr(0, tab);
+      const auto value = line.substr(tab + 1);
+      if (key == "db") {
+        db = value;
+        continue;
+      }
+      char *end = NULL;
+      const double number = strtod(value.c_str(), &end);
+      if (value.empty() || *end || !(std::isfinite(number))) {
+        return false;
+      }
+      if (key == "l") {
+        l = int(number);
+      } else if (key == "m") {
+        m = int(number);
+      } else if (key == "threads") {
+        threads = int(number);
+      } else if (key == "reads_per_sec") {
+        reads_per_sec = number;
+      } else if (key == "ram_budget_gb") {
+        ram_budget_gb = number;
+      }
+    }
+    bool candidate = false;
+    for (const auto &geometry : TUNE_CANDIDATES) {
+      candidate = candidate || (geometry[0] == l && geometry[1] == m);
+    }
+    return candidate && threads > 0;
+  }
+  bool save(const string &path) const {
+    ofstream fh(path, ofstream::out | ofstream::binary);
+    fh << "# Chosen by gt_pro --tune.  Rerun gt_pro --tune, or delete this file, to retune.\n"
+       << "db\t" << db << "\n"
+       << "l\t" << l << "\n"
+       << "m\t" << m << "\n"
+       << "threads\t" << threads << "\n"
+       << "reads_per_sec\t" << uint64_t(reads_per_sec) << "\n"
+       << "ram_budget_gb\t" << ram_budget_gb << "\n";
+    fh.close();
+    return !(fh.fail());
+  }
+};
+
+// Read up to max_bytes from the head of a FASTQ, FASTA or BAM file (past the BAM header),
+// decompressing if necessary, and trim the sample to whole records.  Returns an empty sample on
+// failure, and sets format to the sample's format.
+vector<char> read_tuning_sample(const string &path, InputFormat &format, const uint64_t max_bytes = TUNE_SAMPLE_BYTES) {
+  vector<char> sample(max_bytes);
+  const auto decomp_idx = decompressor(path.c_str());
+  FILE *f = NULL;
+  if (decomp_idx == -1) {
+    f = fopen(path.c_str(), "r");
+  } else if (0 == strcmp(compressors[decomp_idx][2], "tested_and_works")) {
+    f = popen_decompressor(compressors[decomp_idx][1], path.c_str());
+  }
+  if (f == NULL) {
+    errno = 0;
+    return vector<char>();
+  }
+  uint64_t header_bytes = 0;
+  const bool bam = is_bam_path(path);
+  const auto bytes_read = (bam && !(skip_bam_header(f, header_bytes))) ? 0 : fread(sample.data(), 1, sample.size(), f);
+  if (decomp_idx == -1) {
+    fclose(f);
+  } else {
+    pclose(f); // may report SIGPIPE since we stopped reading early;  that's fine
+  }
+  errno = 0;
+  uint64_t size = bytes_read;
+  format = bam ? FORMAT_BAM : detect_format(sample.data(), size);
+  if (size == sample.size()) {
+    auto end = last_record(sample.data(), size, format);
+    if (end == NULL && format == FORMAT_FASTA) {
+      // A long FASTA sequence may be sampled in part.
+      end = find_last(sample.data(), sample.data() + size, '\n');
+      end = end ? end + 1 : NULL;
+    }
+    size = end ? end - sample.data() : 0;
+  }
+  sample.resize(size);
+  return sample;
+}
+
+// Split FASTQ or FASTA text into pieces of at most SEGMENT_SIZE bytes on record boundaries, the way
+// scan_input would.  Returns (offset, size) pairs.
+vector<pair<uint64_t, uint64_t>> record_segments(const char *data, const uint64_t size, const InputFormat format) {
+  vector<pair<uint64_t, uint64_t>> segments;
+  for (uint64_t pos = 0; pos < size;) {
+    uint64_t len = min<uint64_t>(SEGMENT_SIZE, size - pos);
+    if (len == SEGMENT_SIZE && pos + len < size) {
+      const auto end = last_record(data + pos, len, format);
+      if (end == NULL || end == data + pos) {
+        break;
+      }
+      len = end - (data + pos);
+    }
+    segments.push_back(make_pair(pos, len));
+    pos += len;
+  }
+  return segments;
+}
+
+// --prescreen queries reads sampled from the inputs against a sketch of the DB:  every
+// PRESCREEN_SKETCH_RATE-th SNP, picked by a hash of its real id, with all of its k-mers.  The sketch
+// is small enough for its lmer index and bloom filter to stay cache resident, and a species counts
+// as present when the samples hit at least PRESCREEN_MIN_SNPS of its sketch SNPs.
+constexpr auto PRESCREEN_SKETCH_RATE = 256;
+constexpr auto PRESCREEN_MIN_SNPS = 2;
+constexpr auto PRESCREEN_SAMPLE_BYTES = 8 * SEGMENT_SIZE;
+
+// The k-mer index of the sketch:  the entries of the DB's k-mer index for sketch SNPs, in order.
+void build_prescreen_sketch(vector<uint32_t> &sketch, const uint64_t *snps, const uint64_t snps_count,
+                            const uint32_t *kmer_index, const uint64_t kmer_count) {
+  // One bit per virtual SNP keeps the pass over the k-mer index cache friendly.
+  vector<bool> in_sketch(snps_count);
+  for (uint64_t i = 0; i < snps_count; ++i) {
+    in_sketch[i] = mix64(snps[3 * i + 2] & SNP_MAX_REAL_ID) % PRESCREEN_SKETCH_RATE == 0;
+  }
+  for (uint64_t z = 0; z < kmer_count; ++z) {
+    if (in_sketch[kmer_index[z] >> 5]) {
+      sketch.push_back(kmer_index[z]);
+    }
+  }
+}
+
+// The species whose sketch SNPs are hit by reads sampled from the head of each input.
+set<uint64_t> prescreen_species(const uint64_t *snps, const uint64_t snps_count, const uint32_t *sketch,
+                                const uint64_t sketch_count, const vector<string> &paths, const int n_threads) {
+  // About 4 k-mers per lmer bucket and 16 bloom filter bits per k-mer.
+  int l = 16;
+  while (l < 30 && (LSB << (l + 2)) < sketch_count) {
+    ++l;
+  }
+  const int m = l + 6;
+  vector<LmerRange> lmer_index(LSB << l);
+  vector<uint64_t> mmer_bloom((LSB << m) / 64);
+  build_lmer_index_and_bloom(lmer_index.data(), mmer_bloom.data(), sketch, sketch_count, snps, snps_count, K2 - l, m);
+  mutex mtx;
+  set<uint64_t> hit_snps;
+  atomic<int> next_path(0);
+  auto worker = [&]() {
+    for (size_t i = next_path++; i < paths.size(); i = next_path++) {
+      InputFormat format;
+      const auto sample = read_tuning_sample(paths[i], format, PRESCREEN_SAMPLE_BYTES);
+      if (sample.empty()) {
+        unique_lock<mutex> lk(mtx);
+        cerr << chrono_time() << ":  [WARNING] Failed to read a sample of reads to prescreen from " << paths[i] << endl;
+        continue;
+      }
+      vector<uint64_t> kmt;
+      for (const auto &seg : record_segments(sample.data(), sample.size(), format)) {
+        kmer_lookup_chunk(&kmt, lmer_index.data(), mmer_bloom.data(), sketch, snps, sample.data() + seg.first, seg.second,
+                          K2 - l, m, paths[i], 0, NULL, 1, format);
+      }
+      unique_lock<mutex> lk(mtx);
+      hit_snps.insert(kmt.begin(), kmt.end());
+    }
+  };
+  vector<thread> workers;
+  for (int t = 0; t < min<int>(n_threads, paths.size()); ++t) {
+    workers.push_back(thread(worker));
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  map<uint64_t, int> snps_per_species;
+  for (const auto snp : hit_snps) {
+    ++snps_per_species[snp_species(snp)];
+  }
+  set<uint64_t> species;
+  for (const auto &entry : snps_per_species) {
+    if (entry.second >= PRESCREEN_MIN_SNPS) {
+      species.insert(entry.first);
+    }
+  }
+  return species;
+}
+
+// Query throughput, in reads per second, of n_threads threads that each scan the whole sample.
+double calibrate(const LmerRange *lmer_index, const uint64_t *mmer_bloom, const uint32_t *kmers_index,
+                 const uint64_t *snps, const vector<char> &sample, const InputFormat format, const int M2, const int M3,
+                 const int n_threads) {
+  const auto segments = record_segments(sample.data(), sample.size(), format);
+  atomic<int64_t> total_reads(0);
+  auto worker = [&](const int thread_idx) {
+    int64_t n_reads = 0;
+    for (size_t s = 0; s < segments.size(); ++s) {
+      // stagger the starting segment so threads don't march in lock-step
+      const auto &seg = segments[(s + thread_idx) % segments.size()];
+      vector<uint64_t> kmt;
+      const auto n = kmer_lookup_chunk(&kmt, lmer_index, mmer_bloom, kmers_index, snps, sample.data() + seg.first,
+                                       seg.second, M2, M3, "", 0, NULL, 1, format);
+      n_reads += max<int64_t>(n, 0);
+    }
+    total_reads += n_reads;
+  };
+  const auto t_start = steady_time_us();
+  vector<thread> workers;
+  for (int t = 0; t < n_threads; ++t) {
+    workers.push_back(thread(worker, t));
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  const auto elapsed_us = max(steady_time_us() - t_start, 1L);
+  return total_reads * 1e6 / elapsed_us;
+}
+
+// Build every candidate geometry that fits the RAM budget, calibrate it at each thread count,
+// and return the fastest configuration found.  Returns a Tuning with l == 0 if nothing fits.
+Tuning tune(const uint32_t *kmer_index, const uint64_t kmer_count, const uint64_t *snps, const uint64_t snps_count,
+            const vector<char> &sample, const InputFormat sample_format, const double ram_budget_gb,
+            const vector<int> &thread_counts, const int n_inputs) {
+  Tuning best;
+  best.ram_budget_gb = ram_budget_gb;
+  const double db_bytes = kmer_count * sizeof(uint32_t) + snps_count * 3 * sizeof(uint64_t);
+  for (auto &candidate : TUNE_CANDIDATES) {
+    const int L2 = candidate[0];
+    const int M3 = candidate[1];
+    const int M2 = K2 - L2;
+    vector<int> feasible_threads;
+    for (const int t : thread_counts) {
+      MemoryPlan plan;
+      plan.budget_gb = ram_budget_gb;
+      if (plan_memory(plan, {make_pair(L2, M3)}, db_bytes, snps_count, t, true, n_inputs)) {
+        feasible_threads.push_back(t);
+      }
+    }
+    if (feasible_threads.empty()) {
+      cerr << chrono_time() << ":  [Info] Tuning skips -l " << L2 << " -m " << M3 << " which exceeds the RAM budget." << endl;
+      continue;
+    }
+    vector<LmerRange> lmer_index(LSB << L2);
+    vector<uint64_t> mmer_bloom((LSB << M3) / 64);
+    build_lmer_index_and_bloom(lmer_index.data(), mmer_bloom.data(), kmer_index, kmer_count, snps, snps_count, M2, M3);
+    for (const int t : feasible_threads) {
+      const auto reads_per_sec =
+          calibrate(lmer_index.data(), mmer_bloom.data(), kmer_index, snps, sample, sample_format, M2, M3, t);
+      cerr << chrono_time() << ":  [Info] Tuning -l " << L2 << " -m " << M3 << " -t " << t << ":  " << uint64_t(reads_per_sec)
+           << " reads/sec" << endl;
+      if (reads_per_sec > best.reads_per_sec) {
+        best.l = L2;
+        best.m = M3;
+        best.threads = t;
+        best.reads_per_sec = reads_per_sec;
+      }
+    }
+  }
+  return best;
+}
+
+// The benchmark driver (gt_pro_bench.cpp) includes this file to reach the query engine
+// directly, and provides its own main.
+#ifndef GTPRO_NO_MAIN
+// Writes a --cohort matrix as TSV to stdout:  a header line of "snp_id" and the input paths, then
+// a line for each SNP with hits in any input, with its count in each input.
+bool view_matrix(const char *path) {
+  CohortMatrixReader matrix;
+  if (!(matrix.open(path))) {
+    cerr << chrono_time() << ":  [ERROR] Not a whole gt_pro cohort matrix: " << path << endl;
+    return false;
+  }
+  const auto n = matrix.columns.size();
+  printf("snp_id");
+  for (const auto &name : matrix.names) {
+    printf("\t%s", name.c_str());
+  }
+  printf("\n");
+  // Merge the columns by SNP id, with the next row of each column in a min-heap.
+  using Head = tuple<uint64_t, uint64_t, uint64_t>; // snp, column, count
+  priority_queue<Head, vector<Head>, greater<Head>> heads;
+  uint64_t snp, count;
+  for (uint64_t i = 0; i < n; ++i) {
+    if (matrix.columns[i].next(snp, count)) {
+      heads.push(make_tuple(snp, i, count));
+    }
+  }
+  vector<uint64_t> row(n);
+  while (!(heads.empty())) {
+    const auto row_snp = get<0>(heads.top());
+    fill(row.begin(), row.end(), 0);
+    while (!(heads.empty()) && get<0>(heads.top()) == row_snp) {
+      const auto i = get<1>(heads.top());
+      row[i] = get<2>(heads.top());
+      heads.pop();
+      if (matrix.columns[i].next(snp, count)) {
+        heads.push(make_tuple(snp, i, count));
+      }
+    }
+    printf("%" PRId64, row_snp);
+    for (const auto c : row) {
+      printf("\t%" PRId64, c);
+    }
+    printf("\n");
+  }
+  for (uint64_t i = 0; i < n; ++i) {
+    if (matrix.columns[i].malformed()) {
+      cerr << chrono_time() << ":  [ERROR] Malformed column " << matrix.names[i] << " in gt_pro cohort matrix: " << path
+           << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// gt_pro view FILE...:  write the rows of --out-format binary files, or --cohort matrices, as TSV
+// to stdout.
+int view_main(int argc, char **argv) {
+  if (argc < 2) {
+    cerr << "usage: gt_pro view <output.gtpb or cohort.gtpm> [more ...]\n";
+    return EXIT_FAILURE;
+  }
+  for (int i = 1; i < argc; ++i) {
+    if (CohortMatrixReader::is_matrix(argv[i])) {
+      if (!(view_matrix(argv[i]))) {
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    BinaryCountsReader reader;
+    if (!(reader.open(argv[i]))) {
+      cerr << chrono_time() << ":  [ERROR] Not a whole gt_pro binary output file: " << argv[i] << endl;
+      return EXIT_FAILURE;
+    }
+    uint64_t snp, count, rows = 0;
+    while (reader.next(snp, count)) {
+      printf("%" PRId64 "\t%" PRId64 "\n", snp, count);
+      ++rows;
+    }
+    if (reader.malformed() || rows != reader.rows) {
+      cerr << chrono_time() << ":  [ERROR] Malformed rows in gt_pro binary output file: " << argv[i] << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  fflush(stdout);
+  return ferror(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Reads the rows of a gt_pro output file and pairs the two alleles of each site, in order of
+// species and position.  Returns false if the file cannot be read whole.
+bool read_site_counts(const string &path, vector<SiteCounts> &sites) {
+  OutputReader reader;
+  if (!(reader.open(path))) {
+    cerr << chrono_time() << ":  [ERROR] Failed to open gt_pro output " << path << endl;
+    return false;
+  }
+  vector<SiteCounts> alleles;
+  uint64_t snp, count;
+  while (reader.next(snp, count)) {
+    SiteCounts site = {0, 0, {0, 0}};
+    uint64_t allele;
+    if (!(split_snp_id(snp, site.species, allele, site.position)) || allele > 1) {
+      cerr << chrono_time() << ":  [ERROR] Bad SNP id " << snp << " in gt_pro output " << path << endl;
+      return false;
+    }
+    site.counts[allele] = count;
+    alleles.push_back(site);
+  }
+  const auto failed = reader.failed();
+  if (!(reader.close()) || failed) {
+    cerr << chrono_time() << ":  [ERROR] Failed to read gt_pro output " << path << " past row " << reader.rows << endl;
+    return false;
+  }
+  pair_alleles(alleles, sites);
+  return true;
+}
+
+// Writes each line of the SNP dictionary at dict_path whose site has counts, with its
+// whitespace separated fields joined by tabs and followed by the counts of both alleles.
+// The dictionary lines, as well as sites, must be in order of species and then position.
+bool annotate_with_text_dict(const char *dict_path, const vector<SiteCounts> &sites, FILE *out) {
+  uint64_t size;
+  const auto data = map_file(dict_path, size);
+  if (data == NULL) {
+    cerr << chrono_time() << ":  [ERROR] Failed to MMAP SNP dictionary " << dict_path << endl;
+    return false;
+  }
+  madvise((void *)data, size, MADV_SEQUENTIAL);
+  const auto end = data + size;
+  auto site = sites.begin();
+  string joined;
+  for (auto p = data; p < end && site != sites.end();) {
+    auto eol = (const char *)memchr(p, '\n', end - p);
+    eol = eol ? eol : end;
+    if (*p != '#' && !(is_blank(p, eol))) {
+      uint64_t species, position;
+      if (!(parse_site(p, eol, species, position))) {
+        cerr << chrono_time() << ":  [ERROR] Bad species or position at byte " << (p - data) << " of " << dict_path << endl;
+        munmap((void *)data, size);
+        return false;
+      }
+      const SiteCounts key = {species, position, {0, 0}};
+      while (site != sites.end() && *site < key) {
+        ++site;
+      }
+      if (site != sites.end() && !(key < *site)) {
+        joined.clear();
+        join_fields(p, eol, joined);
+        fprintf(out, "%s\t%" PRId64 "\t%" PRId64 "\n", joined.c_str(), site->counts[0], site->counts[1]);
+      }
+    }
+    p = eol + 1;
+  }
+  munmap((void *)data, size);
+  return true;
+}
+
+// gt_pro dict <snp_dict.tsv> [-o <snp_dict.gtpd>]:  convert a SNP dictionary to the binary
+// format, for gt_pro parse --dict.  The output defaults to the input path with .tsv replaced.
+int dict_main(int argc, char **argv) {
+  const char *usage = "usage: gt_pro dict <snp_dict.tsv> [-o <snp_dict.gtpd>]\n";
+  const char *out_arg = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    if (opt != 'o') {
+      cerr << usage;
+      return EXIT_FAILURE;
+    }
+    out_arg = optarg;
+  }
+  if (optind != argc - 1) {
+    cerr << usage;
+    return EXIT_FAILURE;
+  }
+  const string dict_path = argv[optind];
+  string out_path;
+  if (out_arg) {
+    out_path = out_arg;
+  } else {
+    const string ext = ".tsv";
+    const auto has_ext =
+        dict_path.size() > ext.size() && 0 == dict_path.compare(dict_path.size() - ext.size(), ext.size(), ext);
+    out_path = (has_ext ? dict_path.substr(0, dict_path.size() - ext.size()) : dict_path) + ".gtpd";
+  }
+  auto t_start = chrono_time();
+  uint64_t size;
+  const auto data = map_file(dict_path.c_str(), size);
+  if (data == NULL) {
+    cerr << chrono_time() << ":  [ERROR] Failed to MMAP SNP dictionary " << dict_path << endl;
+    return EXIT_FAILURE;
+  }
+  madvise((void *)data, size, MADV_SEQUENTIAL);
+  // First pass:  the key of each line, and where the line starts, in place of the heap offset.
+  vector<DictRecord> records;
+  auto sorted = true;
+  const auto end = data + size;
+  for (auto p = data; p < end;) {
+    auto eol = (const char *)memchr(p, '\n', end - p);
+    eol = eol ? eol : end;
+    if (*p != '#' && !(is_blank(p, eol))) {
+      uint64_t species, position;
+      if (!(parse_site(p, eol, species, position)) || species > 999999 || position >= (LSB << SITE_POSITION_BITS)) {
+        cerr << chrono_time() << ":  [ERROR] Bad species or position at byte " << (p - data) << " of " << dict_path << endl;
+        munmap((void *)data, size);
+        return EXIT_FAILURE;
+      }
+      const DictRecord r = {site_key(species, position), uint64_t(p - data)};
+      sorted = sorted && (records.empty() || records.back().key <= r.key);
+      records.push_back(r);
+    }
+    p = eol + 1;
+  }
+  if (!(sorted)) {
+    stable_sort(records.begin(), records.end(),
+                [](const DictRecord &a, const DictRecord &b) { return a.key < b.key; });
+  }
+  // Second pass:  write the heap in record order, then the records with their heap offsets.
+  const auto tmp_path = out_path + ".tmp";
+  FILE *out = fopen(tmp_path.c_str(), "wb");
+  if (out == NULL) {
+    cerr << chrono_time() << ":  [ERROR] Failed to create " << tmp_path << endl;
+    munmap((void *)data, size);
+    return EXIT_FAILURE;
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+  uint64_t header[3] = {0, records.size(), 0};
+  memcpy(header, DICT_MAGIC, 8);
+  fwrite(header, sizeof(header), 1, out);
+  uint64_t heap_bytes = 0;
+  string joined;
+  for (auto &r : records) {
+    const auto p = data + r.offset;
+    auto eol = (const char *)memchr(p, '\n', end - p);
+    joined.clear();
+    join_fields(p, eol ? eol : end, joined);
+    fwrite(joined.data(), 1, joined.size(), out);
+    r.offset = heap_bytes;
+    heap_bytes += joined.size();
+  }
+  munmap((void *)data, size);
+  const char padding[8] = {0};
+  fwrite(padding, 1, (8 - heap_bytes % 8) % 8, out);
+  heap_bytes += (8 - heap_bytes % 8) % 8;
+  fwrite(records.data(), sizeof(DictRecord), records.size(), out);
+  header[2] = heap_bytes;
+  auto ok = fseek(out, 0, SEEK_SET) == 0 && fwrite(header, sizeof(header), 1, out) == 1;
+  ok = fflush(out) == 0 && !(ferror(out)) && ok;
+  ok = fclose(out) == 0 && ok;
+  ok = ok && rename(tmp_path.c_str(), out_path.c_str()) == 0;
+  if (!(ok)) {
+    cerr << chrono_time() << ":  [ERROR] Failed to write " << out_path << endl;
+    unlink(tmp_path.c_str());
+    return EXIT_FAILURE;
+  }
+  cerr << chrono_time() << ":  Done writing " << records.size() << " SNP sites to " << out_path << ". That took "
+       << (chrono_time() - t_start) / 1000.0 << " seconds." << endl;
+  return EXIT_SUCCESS;
+}
+
+// gt_pro parse --dict <snp_dict.tsv or .gtpd> [-o OUT] <gt_pro output>:  the native equivalent
+// of scripts/gtp_parse.py --v2, writing one line per SNP site with counts, annotated from the
+// dictionary, with the count of each allele in the last two fields.
+int parse_main(int argc, char **argv) {
+  const char *usage =
+      "usage: gt_pro parse --dict <snp_dict.tsv or .gtpd> [-o <out.tsv>] <gt_pro output (.tsv[.gz, ...] or .gtpb)>\n";
+  const char *dict_path = NULL;
+  const char *out_path = NULL;
+  static struct option long_options[] = {{"dict", required_argument, NULL, 'd'},
+                                         {"out", required_argument, NULL, 'o'},
+                                         {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "d:o:", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'd':
+      dict_path = optarg;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      cerr << usage;
+      return EXIT_FAILURE;
+    }
+  }
+  if (dict_path == NULL || optind != argc - 1) {
+    cerr << usage;
+    return EXIT_FAILURE;
+  }
+  vector<SiteCounts> sites;
+  if (!(read_site_counts(argv[optind], sites))) {
+    return EXIT_FAILURE;
+  }
+  FILE *out = out_path ? fopen(out_path, "w") : stdout;
+  if (out == NULL) {
+    cerr << chrono_time() << ":  [ERROR] Failed to create " << out_path << endl;
+    return EXIT_FAILURE;
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+  // A binary dictionary is recognized by its magic, whatever its name.
+  BinaryDict binary_dict;
+  auto ok = true;
+  if (binary_dict.open(dict_path)) {
+    annotate_with_binary_dict(binary_dict, sites, out);
+  } else if (binary_dict.has_magic) {
+    cerr << chrono_time() << ":  [ERROR] Truncated or malformed binary SNP dictionary " << dict_path << endl;
+    ok = false;
+  } else {
+    ok = annotate_with_text_dict(dict_path, sites, out);
+  }
+  auto written = fflush(out) == 0 && !(ferror(out));
+  if (out_path) {
+    written = fclose(out) == 0 && written;
+  }
+  if (!(written)) {
+    cerr << chrono_time() << ":  [ERROR] Failed to write " << (out_path ? out_path : "standard output") << endl;
+  }
+  return ok && written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// gt_pro merge [-o OUT] INPUT...:  sum the counts of gt_pro outputs of either format, plain or
+// compressed, such as those of the lanes or runs of one sample.  The inputs are merged as they
+// stream, so memory holds one row per input whatever their size.  OUT ending in .gtpb is written
+// in the binary format, else as TSV, compressed if it ends in .gz, .bz2 or .lz4.
+int merge_main(int argc, char **argv) {
+  const char *usage = "usage: gt_pro merge [-o <out.tsv[.gz, ...] or out.gtpb>] <gt_pro output> [more ...]\n";
+  string out_path;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    if (opt != 'o') {
+      cerr << usage;
+      return EXIT_FAILURE;
+    }
+    out_path = optarg;
+  }
+  if (optind == argc) {
+    cerr << usage;
+    return EXIT_FAILURE;
+  }
+  const auto n = argc - optind;
+  vector<unique_ptr<OutputReader>> readers;
+  for (int i = 0; i < n; ++i) {
+    readers.emplace_back(new OutputReader());
+    if (!(readers[i]->open(argv[optind + i]))) {
+      cerr << chrono_time() << ":  [ERROR] Failed to open gt_pro output " << argv[optind + i] << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  const auto ext = strlen(".gtpb");
+  const bool binary = out_path.size() > ext && 0 == out_path.compare(out_path.size() - ext, ext, ".gtpb");
+  const auto comp_idx = (binary || out_path.empty()) ? -1 : decompressor(out_path.c_str());
+  FILE *out = stdout;
+  if (comp_idx != -1) {
+    if (0 != strcmp(compressors[comp_idx][2], "tested_and_works")) {
+      cerr << chrono_time() << ":  [ERROR] Required compressor " << compressors[comp_idx][1] << " is unavailable: " << out_path
+           << endl;
+      return EXIT_FAILURE;
+    }
+    out = popen_compressor(compressors[comp_idx][1], out_path.c_str());
+  } else if (!(out_path.empty())) {
+    out = fopen(out_path.c_str(), "wb");
+  }
+  errno = 0;
+  if (out == NULL) {
+    cerr << chrono_time() << ":  [ERROR] Failed to create " << out_path << endl;
+    return EXIT_FAILURE;
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+  if (binary) {
+    fwrite(BINARY_MAGIC, 1, 8, out);
+  }
+  vector<OutputReader *> sources;
+  for (const auto &reader : readers) {
+    sources.push_back(reader.get());
+  }
+  uint64_t rows = 0, hits = 0, previous_snp = 0;
+  int bad_reader;
+  uint64_t bad_snp;
+  auto ok = merge_counts(
+      sources,
+      [&](const uint64_t snp, const uint64_t count) {
+        if (binary) {
+          put_varint(out, snp - previous_snp);
+          put_varint(out, count);
+          previous_snp = snp;
+        } else {
+          fprintf(out, "%" PRId64 "\t%" PRId64 "\n", snp, count);
+        }
+        ++rows;
+        hits += count;
+        return true;
+      },
+      bad_reader, bad_snp);
+  if (bad_reader != -1) {
+    cerr << chrono_time() << ":  [ERROR] Rows out of order at SNP " << bad_snp << " in " << argv[optind + bad_reader] << endl;
+  }
+  uint64_t reads = 0;
+  for (int i = 0; i < n; ++i) {
+    const auto failed = readers[i]->failed();
+    if (!(readers[i]->close()) || failed) {
+      cerr << chrono_time() << ":  [ERROR] Failed to read gt_pro output " << argv[optind + i] << " past row "
+           << readers[i]->rows << endl;
+      ok = false;
+    }
+    // Text outputs do not record their reads.
+    reads += readers[i]->is_binary ? readers[i]->binary.reads : 0;
+  }
+  if (binary) {
+    put_le64(out, rows);
+    put_le64(out, hits);
+    put_le64(out, reads);
+    fwrite(BINARY_END_MAGIC, 1, 8, out);
+  }
+  auto written = fflush(out) == 0 && !(ferror(out));
+  if (comp_idx != -1) {
+    written = pclose(out) == 0 && written;
+  } else if (!(out_path.empty())) {
+    written = fclose(out) == 0 && written;
+  }
+  errno = 0;
+  if (!(written)) {
+    cerr << chrono_time() << ":  [ERROR] Failed to write " << (out_path.empty() ? "standard output" : out_path) << endl;
+  }
+  if (!(ok && written) && !(out_path.empty())) {
+    unlink(out_path.c_str());
+  }
+  return ok && written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
 int main(int argc, char **argv) {
 
   errno = 0;
 
+  // Subcommands come first, and take their own arguments.
+  if (argc > 1 && 0 == strcmp(argv[1], "view")) {
+    return view_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && 0 == strcmp(argv[1], "parse")) {
+    return parse_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && 0 == strcmp(argv[1], "dict")) {
+    return dict_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && 0 == strcmp(argv[1], "merge")) {
+    return merge_main(argc - 1, argv + 1);
+  }
+
   extern char *optarg;
   extern int optind;
 
@@ -1564,9 +5165,189 @@ int main(int argc, char **argv) {
   auto explicit_l = false;
   auto explicit_m = false;
 
+  auto explicit_t = false;
+
+  string counters_path = "";
+  auto perf_counters = false;
+
+  auto tune_mode = false;
+  double tune_ram_gb = 0.0;
+
+  double max_ram_gb = 0.0;
+  double match_buffer_mb = 0.0;
+
+  auto paired = false;
+  auto interleaved = false;
+
+  SnapshotPlan snapshots;
+  StopPlan stop;
+  Subsample subsample;
+
+  set<uint64_t> species;
+  auto prescreen = false;
+
+  OutputFormat out_format = OUT_TSV;
+  const char *dict_path = NULL;
+  string cohort_path;
+  string spill_dir;
+
+  // Long options have no single letter equivalent;  their codes start past the char range.
+  enum {
+    OPT_COUNTERS = 256,
+    OPT_PERF_COUNTERS,
+    OPT_TUNE,
+    OPT_TUNE_RAM,
+    OPT_MAX_RAM,
+    OPT_MATCH_BUFFER_MB,
+    OPT_PAIRED,
+    OPT_INTERLEAVED,
+    OPT_SNAPSHOT_READS,
+    OPT_SNAPSHOT_SECS,
+    OPT_SNAPSHOT_DELTA,
+    OPT_STOP_COVERAGE,
+    OPT_STOP_NEW_SNPS,
+    OPT_SUBSAMPLE,
+    OPT_SPECIES,
+    OPT_SPECIES_FILE,
+    OPT_PRESCREEN,
+    OPT_OUT_FORMAT,
+    OPT_DICT,
+    OPT_COHORT,
+    OPT_SPILL_DIR
+  };
+  const struct option long_options[] = {
+      {"counters", required_argument, NULL, OPT_COUNTERS},
+      {"perf-counters", no_argument, NULL, OPT_PERF_COUNTERS},
+      {"tune", no_argument, NULL, OPT_TUNE},
+      {"tune-ram", required_argument, NULL, OPT_TUNE_RAM},
+      {"max-ram", required_argument, NULL, OPT_MAX_RAM},
+      {"match-buffer-mb", required_argument, NULL, OPT_MATCH_BUFFER_MB},
+      {"paired", no_argument, NULL, OPT_PAIRED},
+      {"interleaved", no_argument, NULL, OPT_INTERLEAVED},
+      {"snapshot-reads", required_argument, NULL, OPT_SNAPSHOT_READS},
+      {"snapshot-secs", required_argument, NULL, OPT_SNAPSHOT_SECS},
+      {"snapshot-delta", no_argument, NULL, OPT_SNAPSHOT_DELTA},
+      {"stop-coverage", required_argument, NULL, OPT_STOP_COVERAGE},
+      {"stop-new-snps", required_argument, NULL, OPT_STOP_NEW_SNPS},
+      {"subsample", required_argument, NULL, OPT_SUBSAMPLE},
+      {"species", required_argument, NULL, OPT_SPECIES},
+      {"species-file", required_argument, NULL, OPT_SPECIES_FILE},
+      {"prescreen", no_argument, NULL, OPT_PRESCREEN},
+      {"out-format", required_argument, NULL, OPT_OUT_FORMAT},
+      {"dict", required_argument, NULL, OPT_DICT},
+      {"cohort", required_argument, NULL, OPT_COHORT},
+      {"spill-dir", required_argument, NULL, OPT_SPILL_DIR},
+      {NULL, 0, NULL, 0},
+  };
+
   int opt;
-  while ((opt = getopt(argc, argv, "fl:m:d:C:t:o:h")) != -1) {
+  while ((opt = getopt_long(argc, argv, "fl:m:d:C:t:o:h", long_options, NULL)) != -1) {
     switch (opt) {
+    case OPT_COUNTERS:
+      counters_path = optarg;
+      break;
+    case OPT_PERF_COUNTERS:
+      perf_counters = true;
+      break;
+    case OPT_TUNE:
+      tune_mode = true;
+      break;
+    case OPT_TUNE_RAM:
+      tune_ram_gb = number_arg("--tune-ram", optarg, fname);
+      break;
+    case OPT_MAX_RAM:
+      max_ram_gb = number_arg("--max-ram", optarg, fname);
+      break;
+    case OPT_MATCH_BUFFER_MB:
+      match_buffer_mb = number_arg("--match-buffer-mb", optarg, fname);
+      if (match_buffer_mb <= 0) {
+        cerr << "--match-buffer-mb takes a positive size in MB\n";
+        display_usage(fname);
+        exit(1);
+      }
+      break;
+    case OPT_PAIRED:
+      paired = true;
+      break;
+    case OPT_INTERLEAVED:
+      interleaved = true;
+      break;
+    case OPT_SNAPSHOT_READS:
+      snapshots.every_reads = whole_number_arg("--snapshot-reads", optarg, fname);
+      break;
+    case OPT_SNAPSHOT_SECS:
+      snapshots.every_secs = number_arg("--snapshot-secs", optarg, fname);
+      break;
+    case OPT_SNAPSHOT_DELTA:
+      snapshots.delta = true;
+      break;
+    case OPT_STOP_COVERAGE:
+      stop.coverage = number_arg("--stop-coverage", optarg, fname);
+      // Every SNP found has at least one hit, so a mean of 1 or less is met by the first segment.
+      if (stop.coverage <= 1) {
+        cerr << "--stop-coverage takes a mean coverage above 1\n";
+        display_usage(fname);
+        exit(1);
+      }
+      break;
+    case OPT_STOP_NEW_SNPS:
+      stop.new_snps_per_million = number_arg("--stop-new-snps", optarg, fname);
+      break;
+    case OPT_SUBSAMPLE: {
+      // A fraction below 1, or else a whole number of fragments.
+      const double value = number_arg("--subsample", optarg, fname);
+      if (value > 0 && value < 1) {
+        subsample.fraction = value;
+      } else if (value >= 1 && value == floor(value)) {
+        subsample.count = uint64_t(value);
+      } else {
+        cerr << "--subsample takes a fraction between 0 and 1, or a whole number of reads\n";
+        display_usage(fname);
+        exit(1);
+      }
+      break;
+    }
+    case OPT_SPECIES:
+      if (!(parse_species_list(optarg, species))) {
+        cerr << "--species takes 6 digit species ids separated by commas\n";
+        display_usage(fname);
+        exit(1);
+      }
+      break;
+    case OPT_SPECIES_FILE: {
+      ifstream fh(optarg);
+      stringstream text;
+      text << fh.rdbuf();
+      if (!(fh) || !(parse_species_list(text.str(), species))) {
+        cerr << "--species-file takes a readable file of 6 digit species ids\n";
+        display_usage(fname);
+        exit(1);
+      }
+      break;
+    }
+    case OPT_PRESCREEN:
+      prescreen = true;
+      break;
+    case OPT_OUT_FORMAT:
+      if (0 == strcmp(optarg, "tsv")) {
+        out_format = OUT_TSV;
+      } else if (0 == strcmp(optarg, "binary")) {
+        out_format = OUT_BINARY;
+      } else {
+        cerr << "--out-format is tsv or binary\n";
+        display_usage(fname);
+        exit(1);
+      }
+      break;
+    case OPT_DICT:
+      dict_path = optarg;
+      break;
+    case OPT_COHORT:
+      cohort_path = optarg;
+      break;
+    case OPT_SPILL_DIR:
+      spill_dir = optarg;
+      break;
     case 'd':
       dbflag = true;
       db_path = optarg;
@@ -1575,17 +5356,18 @@ int main(int argc, char **argv) {
       c_prefix = optarg;
       break;
     case 't':
-      n_threads = max(1, min(8 * n_threads, stoi(optarg)));
+      n_threads = max<int>(1, min<uint64_t>(8 * n_threads, whole_number_arg("-t", optarg, fname)));
+      explicit_t = true;
       break;
     case 'o':
       oname = optarg;
       break;
     case 'l':
-      L2 = stoi(optarg);
+      L2 = whole_number_arg("-l", optarg, fname);
       explicit_l = true;
       break;
     case 'm':
-      M3 = stoi(optarg);
+      M3 = whole_number_arg("-m", optarg, fname);
       explicit_m = true;
       break;
     case 'f':
@@ -1604,6 +5386,102 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  if (perf_counters && counters_path.empty()) {
+    counters_path = "-";
+  }
+
+  if (tune_mode && optind == argc) {
+    cerr << "--tune needs at least one input file to sample reads from\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  if (paired && interleaved) {
+    cerr << "please specify at most one of --paired and --interleaved\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  if (snapshots.delta && !(snapshots.enabled())) {
+    cerr << "--snapshot-delta needs --snapshot-reads or --snapshot-secs\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  if (snapshots.enabled() && (optind != argc || paired || tune_mode)) {
+    cerr << "--snapshot-reads and --snapshot-secs apply to reads streamed from stdin;  specify no input files\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  if (subsample.count && (snapshots.enabled() || stop.enabled())) {
+    cerr << "--subsample with a read count needs all reads before it can count any;  use a fraction with "
+            "--snapshot-* or --stop-*\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  if (prescreen && (optind == argc || !(species.empty()))) {
+    cerr << "--prescreen samples reads from the input files to choose species;  specify inputs, and not --species\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  if (dict_path && (out_format != OUT_TSV || snapshots.enabled())) {
+    cerr << "--dict writes annotated TSV output;  it does not apply to --out-format binary or --snapshot-*\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  if (!(cohort_path.empty()) && (optind == argc || dict_path || out_format != OUT_TSV || tune_mode)) {
+    cerr << "--cohort writes the counts of the input files to one matrix;  specify inputs, and not --dict, "
+            "--out-format or --tune\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  if (!(spill_dir.empty()) && access(spill_dir.c_str(), W_OK | X_OK) != 0) {
+    cerr << "--spill-dir " << spill_dir << " is not a writable directory\n";
+    errno = 0;
+    display_usage(fname);
+    exit(1);
+  }
+
+  // The dictionary is checked before loading the DB, as it takes a fraction of the time.
+  BinaryDict dict;
+  if (dict_path) {
+    if (!(dict.open(dict_path))) {
+      cerr << chrono_time() << ":  [ERROR] " << dict_path
+           << (dict.has_magic ? " is a truncated or malformed binary SNP dictionary\n"
+                              : " is not a binary SNP dictionary;  convert it with gt_pro dict\n");
+      exit(1);
+    }
+    out_format = OUT_ANNOTATED;
+  }
+
+  if (paired && (optind == argc || (argc - optind) % 2 != 0)) {
+    cerr << "--paired needs an R1 file and an R2 file for each sample\n";
+    display_usage(fname);
+    exit(1);
+  }
+
+  // Under --paired, the inputs alternate R1, R2, R1, R2, ...  Results are named after R1.
+  vector<const char *> input_paths;
+  vector<const char *> mate_paths;
+  for (int i = optind; i < argc; ++i) {
+    if (paired && (i - optind) % 2 != 0) {
+      mate_paths.push_back(argv[i]);
+    } else {
+      input_paths.push_back(argv[i]);
+    }
+  }
+
+  if (paired && any_of(argv + optind, argv + argc, [](const char *path) { return is_bam_path(path); })) {
+    cerr << "--paired reads FASTQ or FASTA files;  for BAM with mates in consecutive records, use --interleaved\n";
+    display_usage(fname);
+    exit(1);
+  }
+
   if (explicit_l != explicit_m) {
     cerr << chrono_time() << "please specify both or neither of -l and -m\n";
     display_usage(fname);
@@ -1645,57 +5523,9 @@ int main(int argc, char **argv) {
   DBIndex<uint32_t> db_kmer_index(dbroot + dbbase + "_optimized_db_kmer_index.bin");
   const bool recompute_kmer_index = db_kmer_index.mmap(db_filesize > 0);
 
-
-  {
-    int l2 = L2;
-    int m3 = M3;
-    const bool found_optimal_vals = choose_optimal_l_and_m(l2, m3, db_kmer_index.dataSize() + db_snps.dataSize(), explicit_l && explicit_m);
-    // cerr << "Found optimal vals: " << found_optimal_vals << endl;
-    if (explicit_l || explicit_m) {
-      if (found_optimal_vals && (l2 != L2 || m3 != M3)) {
-        cerr << chrono_time() << ":  [WARNING] Arguments -l " << L2 << " -m " << M3 << " override optimal values -l " << l2 << " -m " << m3 << endl;
-      }
-    } else {
-      if (found_optimal_vals) {
-        cerr << chrono_time() << ":  [Info] Using -l " << l2 << " -m " << m3 << " as optimal for system RAM" << endl;
-      } else {
-        cerr << chrono_time() << ":  [WARNING] Using -l " << l2 << " -m " << m3 << " parameter defaults.  Optimal values could not be determined on this system;  performance may suffer." << endl;
-      }
-      L2 = l2;
-      M3 = m3;
-    }
-  }
-
-  const auto M2 = K2 - L2;
-
-  assert(L2 > 0 && "Unsupported value of -l");
-  assert(L2 <= 32 && "Unsupported value of -l");
-  assert(M2 > 0 && "Unsupported value of -m");
-  assert(M2 < 64 && "Unsupported value of -m");
-  assert(M3 > 0 && "Unsupported value of -m");
-  assert(M3 < 64 && "Unsupported value of -m");
-
-  const auto LMER_MASK = (LSB << L2) - LSB;
-  const auto MMER_MASK = (LSB << M2) - LSB;
-  const auto MAX_BLOOM = (LSB << M3) - LSB;
-
-  // Bit vector with one presence/absence bit for every possible M3-bit kmer suffix (the M3
-  // LSBs of a kmer's nucleotide sequence).
-  DBIndex<uint64_t> db_mmer_bloom(dbroot + dbbase + "_optimized_db_mmer_bloom_" + to_string(M3) + ".bin", (1 + MAX_BLOOM) / 64);
-  const bool recompute_mmer_bloom = db_mmer_bloom.mmap();
-
-  // For every kmer in the original DB, the most-signifficant L2 bits of the kmer's nucleotide sequence
-  // are called that kmer's lmer.  Kmers that share the same lmer occupy a range of consecutive
-  // positions in the kmer_index, and that range is lmer_index[lmer].
-  DBIndex<LmerRange> db_lmer_index(dbroot + dbbase + "_optimized_db_lmer_index_" + to_string(L2) + ".bin", 1 + LMER_MASK);
-  const bool recompute_lmer_index = db_lmer_index.mmap();
-  LmerRange *lmer_index = db_lmer_index.address();
-
   assert(recompute_kmer_index == recompute_snps &&
          "Please delete all of the optimized DB bin files before recomputing any of them.");
 
-  const bool recompute_everything = recompute_kmer_index || recompute_snps || recompute_lmer_index || recompute_mmer_bloom;
-
   int fd = -1;
   uint64_t *db_data = NULL;
 
@@ -1927,84 +5757,319 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (recompute_lmer_index || recompute_mmer_bloom) {
-    cerr << chrono_time() << ":  Recomputing bloom index and/or filter." << endl;
-    uint64_t start = 0;
-    uint64_t last_lmer;
-    const auto kmer_index = db_kmer_index.address();
-    const auto kmer_count = db_kmer_index.elementCount();
-    const auto snps = db_snps.address();
-    const auto snps_count = db_snps.elementCount() / 3;
-    auto mmer_bloom = db_mmer_bloom.address();
-    t_last_progress_update = chrono_time();
-    for (uint64_t end = 0; end < kmer_count; ++end) {
-      if (((end + 1) % (10 * 1000 * 1000)) == 0 && (chrono_time() - t_last_progress_update >= 10 * 1000)) {
-        // print progress update every 10 million kmers / but not more often than every 10 seconds
-        t_last_progress_update = chrono_time();
-        const auto t_elapsed = t_last_progress_update - l_start;
-        const auto fraction_complete = double(end + 1) / kmer_count;
-        const auto t_remaining = (t_elapsed / fraction_complete) * (1.0 - fraction_complete);
-        cerr << t_last_progress_update << ":  Processed almost " << ((end + 1) / (1000 * 1000)) << " million kmers ("
-             << int(fraction_complete * 1000) / 10.0 << " percent).  Expect to complete processing in "
-             << int(t_remaining / (60 * 100)) / 10.0 << " more minutes." << endl;
+  // Caches derived from the DB are keyed by its files as saved, so those save the DB first if it
+  // was just built.
+  bool db_saved = !(recompute_kmer_index);
+  auto save_db = [&]() {
+    if (!(db_saved)) {
+      db_snps.save();
+      db_kmer_index.save();
+      db_saved = true;
+    }
+  };
+
+  // With --prescreen, the species come from a first pass over reads sampled from the inputs, and
+  // the sub-DB built for them below is not cached, since it varies from run to run.
+  if (prescreen) {
+    DBIndex<uint32_t> sketch_db(dbroot + dbbase + "_optimized_db_prescreen_sketch.bin");
+    if (sketch_db.mmap()) {
+      build_prescreen_sketch(*sketch_db.getElementsVector(), db_snps.address(), db_snps.elementCount() / 3,
+                             db_kmer_index.address(), db_kmer_index.elementCount());
+      if (!(sketch_db.getElementsVector()->empty())) {
+        sketch_db.save();
       }
-      const auto kmi = kmer_index[end];
-      const auto offset = kmi & 0x1f;
-      const auto snp_id = kmi >> 5;
-      assert(0 <= offset && offset <= 31 && offset < K);
-      assert(0 <= snp_id && snp_id <= snps_count);
-      const auto *snp_repr = &(snps[3 * snp_id]);
-      const auto low_bits = snp_repr[0] >> (62 - (offset * BITS_PER_BASE));
-      const auto high_bits = (snp_repr[1] << (offset * BITS_PER_BASE)) & FULL_KMER;
-      assert(((snp_repr[0] >> 62) == (snp_repr[1] & 0x3)) &&
-             "SNP position differs in two supposedly redundant representations.");
-      auto kmer = high_bits | low_bits;
-      const auto kmer_rc = reverse_complement(kmer);
-      if (kmer_rc < kmer) {
-        // remember only the smaller of the kmer pair is in the DB, index, and bloom filter
-        kmer = kmer_rc;
-      }
-      const auto lmer = kmer >> M2;
-      if (recompute_lmer_index) {
-        if ((end > 0) && (lmer != last_lmer)) {
-          start = end;
+    }
+    vector<string> sample_paths;
+    for (const auto path : input_paths) {
+      sample_paths.push_back(strlen(c_prefix) && path[0] != '/' ? string(c_prefix) + "/" + path : string(path));
+    }
+    if (sketch_db.elementCount() > 0) {
+      species = prescreen_species(db_snps.address(), db_snps.elementCount() / 3, sketch_db.address(),
+                                  sketch_db.elementCount(), sample_paths, n_threads);
+    }
+    // When every species of the DB is found, the sub-DB would be the whole DB;  use it as is.
+    set<uint64_t> db_species;
+    if (!(species.empty())) {
+      auto previous = numeric_limits<uint64_t>::max();
+      for (uint64_t i = 0; i < db_snps.elementCount() / 3; ++i) {
+        const auto sp = snp_species(db_snps.address()[3 * i + 2] & SNP_MAX_REAL_ID);
+        if (sp != previous) {
+          db_species.insert(sp);
+          previous = sp;
+        }
+      }
+    }
+    if (species.empty()) {
+      cerr << chrono_time() << ":  [WARNING] Prescreen found no species;  genotyping against the whole DB." << endl;
+    } else if (species == db_species) {
+      cerr << chrono_time() << ":  [Info] Prescreen found all " << species.size() << " species of the DB;  using it whole."
+           << endl;
+      species.clear();
+    } else {
+      ostringstream found;
+      for (const auto sp : species) {
+        found << (found.tellp() ? "," : "") << sp;
+      }
+      cerr << chrono_time() << ":  [Info] Prescreen found " << species.size() << " species:  " << found.str() << endl;
+    }
+  }
+
+  // With --species, the rest of the run uses a sub-DB of just those species, cached next to the DB
+  // under a name derived from the species list.  Its lmer index and bloom filter, tuning file and
+  // outputs are named after the sub-DB as well.  The cache is used only if its key file names the
+  // same DB files and species list as this run;  the name alone may collide.
+  DBIndex<uint64_t> *p_snps_db = &db_snps;
+  DBIndex<uint32_t> *p_kmer_db = &db_kmer_index;
+  unique_ptr<DBIndex<uint64_t>> species_snps_db;
+  unique_ptr<DBIndex<uint32_t>> species_kmer_db;
+  if (!(species.empty())) {
+    if (!(prescreen)) {
+      save_db();
+    }
+    ostringstream ids;
+    uint64_t h = 14695981039346656037ULL;
+    for (const auto sp : species) {
+      h = (h ^ sp) * 1099511628211ULL;
+      ids << (ids.tellp() ? "," : "") << sp;
+    }
+    const string species_key = "db\t" + db_files_key(dbroot + dbbase) + "\nspecies\t" + ids.str() + "\n";
+    char tag[48];
+    snprintf(tag, sizeof(tag), "_species_%d_%016" PRIx64, int(species.size()), h);
+    dbbase += tag;
+    const string species_key_path = dbroot + dbbase + "_optimized_db_species.tsv";
+    ifstream key_fh(species_key_path);
+    stringstream cached_key;
+    cached_key << key_fh.rdbuf();
+    const bool cached = !(prescreen) && cached_key.str() == species_key;
+    if (!(cached) && !(prescreen) && file_exists(species_key_path.c_str())) {
+      cerr << chrono_time() << ":  [WARNING] Cached sub-DB " << dbbase
+           << " was derived from other DB files or species;  rebuilding it." << endl;
+    }
+    species_snps_db.reset(new DBIndex<uint64_t>(dbroot + dbbase + "_optimized_db_snps.bin"));
+    species_kmer_db.reset(new DBIndex<uint32_t>(dbroot + dbbase + "_optimized_db_kmer_index.bin"));
+    const bool recompute_species_snps = !(cached) || species_snps_db->mmap();
+    const bool recompute_species_kmers = !(cached) || species_kmer_db->mmap();
+    assert(recompute_species_snps == recompute_species_kmers &&
+           "Please delete all of the species sub-DB bin files before recomputing any of them.");
+    if (recompute_species_snps) {
+      cerr << chrono_time() << ":  [Info] Deriving a sub-DB for " << species.size() << " species from " << db_path << endl;
+      restrict_to_species(*species_snps_db->getElementsVector(), *species_kmer_db->getElementsVector(),
+                          db_snps.address(), db_snps.elementCount() / 3, db_kmer_index.address(),
+                          db_kmer_index.elementCount(), species);
+      if (species_kmer_db->getElementsVector()->empty()) {
+        cerr << chrono_time() << ":  [ERROR] The DB holds no SNPs for any species given to --species." << endl;
+        exit(EXIT_FAILURE);
+      }
+      if (!(prescreen)) {
+        // Indexes built from an earlier sub-DB of this name are stale;  the key file goes last,
+        // so that an interrupted rebuild is redone.
+        unlink(species_key_path.c_str());
+        for (int x = 1; x < 64; ++x) {
+          unlink((dbroot + dbbase + "_optimized_db_lmer_index_" + to_string(x) + ".bin").c_str());
+          unlink((dbroot + dbbase + "_optimized_db_mmer_bloom_" + to_string(x) + ".bin").c_str());
         }
-        // Invariant:  The data loaded so far for lmer reside at kmer_index[start...]
-        assert(start <= MAX_START);
-        const auto len = end - start + 1;
-        assert(len < MAX_LEN);
-        assert(lmer <= LMER_MASK);
-        lmer_index[lmer] = (start << LEN_BITS) | len;
-        last_lmer = lmer;
+        errno = 0;
+        species_snps_db->save();
+        species_kmer_db->save();
+        ofstream key_out(species_key_path, ofstream::out | ofstream::binary);
+        key_out << species_key;
+      }
+    }
+    cerr << chrono_time() << ":  [Info] Using sub-DB " << dbbase << " with " << species_snps_db->elementCount() / 3
+         << " snps and " << species_kmer_db->elementCount() << " kmers." << endl;
+    p_snps_db = species_snps_db.get();
+    p_kmer_db = species_kmer_db.get();
+  }
+  auto &snps_db = *p_snps_db;
+  auto &kmer_db = *p_kmer_db;
+
+  const string tuning_path = dbroot + dbbase + "_optimized_db_tuning.tsv";
+  Tuning tuning;
+
+  if (tune_mode) {
+    if (explicit_l || explicit_m) {
+      cerr << chrono_time() << ":  [WARNING] Ignoring -l and -m in --tune mode." << endl;
+      explicit_l = explicit_m = false;
+    }
+    string sample_path = argv[optind];
+    if (strlen(c_prefix) && sample_path[0] != '/') {
+      sample_path = string(c_prefix) + "/" + sample_path;
+    }
+    InputFormat sample_format;
+    const auto sample = read_tuning_sample(sample_path, sample_format);
+    if (sample.empty()) {
+      cerr << chrono_time() << ":  [ERROR] Failed to read a sample of reads for tuning from " << sample_path << endl;
+      exit(EXIT_FAILURE);
+    }
+    const double ram_budget_gb = tune_ram_gb > 0 ? tune_ram_gb : max_ram_gb > 0 ? max_ram_gb : 0.9 * system_ram();
+    vector<int> thread_counts = {n_threads};
+    if (!(explicit_t) && n_threads > 1) {
+      thread_counts.insert(thread_counts.begin(), n_threads / 2); // hyperthreads may or may not help
+    }
+    cerr << chrono_time() << ":  [Info] Tuning for a RAM budget of " << ram_budget_gb << " GB with " << sample.size()
+         << " bytes of reads from " << sample_path << endl;
+    tuning = tune(kmer_db.address(), kmer_db.elementCount(), snps_db.address(), snps_db.elementCount() / 3, sample,
+                  sample_format, ram_budget_gb, thread_counts, input_paths.size());
+    if (tuning.l == 0) {
+      cerr << chrono_time() << ":  [ERROR] No candidate configuration fits in " << ram_budget_gb << " GB of RAM." << endl;
+      exit(EXIT_FAILURE);
+    }
+    save_db();
+    tuning.db = db_files_key(dbroot + dbbase);
+    if (!(tuning.save(tuning_path))) {
+      cerr << chrono_time() << ":  [ERROR] Failed to save tuning result to " << tuning_path << endl;
+      exit(EXIT_FAILURE);
+    }
+    cerr << chrono_time() << ":  [Info] Tuning chose -l " << tuning.l << " -m " << tuning.m << " -t " << tuning.threads
+         << ", saved to " << tuning_path << endl;
+  } else if (!(explicit_l || explicit_m) && file_exists(tuning_path.c_str())) {
+    if (!(tuning.load(tuning_path))) {
+      cerr << chrono_time() << ":  [WARNING] Ignoring malformed tuning file " << tuning_path << endl;
+      tuning = Tuning();
+    } else if (tuning.db.empty() || tuning.db != db_files_key(dbroot + dbbase)) {
+      cerr << chrono_time() << ":  [WARNING] Ignoring tuning file " << tuning_path
+           << ", made for DB files that have since changed;  rerun with --tune to retune." << endl;
+      tuning = Tuning();
+    }
+  }
+
+  if (tuning.l && !(explicit_l || explicit_m)) {
+    L2 = tuning.l;
+    M3 = tuning.m;
+    if (!(explicit_t)) {
+      n_threads = tuning.threads;
+    }
+    cerr << chrono_time() << ":  [Info] Using -l " << L2 << " -m " << M3 << " -t " << n_threads << " as tuned in "
+         << tuning_path << endl;
+    if (!(tune_mode) && tuning.ram_budget_gb > system_ram(true, tuning.ram_budget_gb)) {
+      cerr << chrono_time() << ":  [WARNING] This system has less RAM than the " << tuning.ram_budget_gb
+           << " GB budget the tuning assumed;  consider rerunning with --tune." << endl;
+    }
+  } else {
+    int l2 = L2;
+    int m3 = M3;
+    const bool found_optimal_vals =
+        choose_optimal_l_and_m(l2, m3, kmer_db.dataSize() + snps_db.dataSize(), explicit_l && explicit_m);
+    // cerr << "Found optimal vals: " << found_optimal_vals << endl;
+    if (explicit_l || explicit_m) {
+      if (found_optimal_vals && (l2 != L2 || m3 != M3)) {
+        cerr << chrono_time() << ":  [WARNING] Arguments -l " << L2 << " -m " << M3 << " override optimal values -l " << l2 << " -m " << m3 << endl;
+      }
+    } else {
+      if (!(species.empty()) && shrink_geometry(l2, m3, kmer_db.elementCount())) {
+        cerr << chrono_time() << ":  [Info] Using -l " << l2 << " -m " << m3 << " to suit the " << kmer_db.elementCount()
+             << " kmers of the sub-DB" << endl;
+      } else if (found_optimal_vals) {
+        cerr << chrono_time() << ":  [Info] Using -l " << l2 << " -m " << m3 << " as optimal for system RAM" << endl;
+      } else {
+        cerr << chrono_time() << ":  [WARNING] Using -l " << l2 << " -m " << m3 << " parameter defaults.  Optimal values could not be determined on this system;  performance may suffer." << endl;
       }
-      if (recompute_mmer_bloom) {
-        const uint64_t bloom_index = kmer & MAX_BLOOM;
-        mmer_bloom[bloom_index / 64] |= ((uint64_t)1) << (bloom_index % 64);
+      L2 = l2;
+      M3 = m3;
+    }
+  }
+
+  MemoryPlan plan;
+  if (max_ram_gb > 0) {
+    // The geometry chosen above comes first;  unless it was given explicitly, smaller ones
+    // may stand in for it when it does not fit.
+    vector<pair<int, int>> candidates = {make_pair(L2, M3)};
+    if (!(explicit_l || explicit_m)) {
+      for (int i = sizeof(TUNE_CANDIDATES) / sizeof(TUNE_CANDIDATES[0]) - 1; i >= 0; --i) {
+        const int l = TUNE_CANDIDATES[i][0];
+        const int m = TUNE_CANDIDATES[i][1];
+        if (index_bytes_for(l, m) < index_bytes_for(L2, M3)) {
+          candidates.push_back(make_pair(l, m));
+        }
       }
     }
+    plan.budget_gb = max_ram_gb;
+    const double db_bytes = kmer_db.dataSize() + snps_db.dataSize();
+    if (!(plan_memory(plan, candidates, db_bytes, snps_db.elementCount() / 3, n_threads, explicit_t,
+                      max(1, int(input_paths.size()))))) {
+      const auto smallest = candidates.back();
+      cerr << chrono_time() << ":  [ERROR] --max-ram " << max_ram_gb << " GB is too small:  the DB alone takes "
+           << db_bytes / (1ULL << 30) << " GB, and -l " << smallest.first << " -m " << smallest.second << " another "
+           << index_bytes_for(smallest.first, smallest.second) / (1ULL << 30) << " GB, before reads and matches." << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (plan.l != L2 || plan.m != M3 || plan.n_threads != n_threads) {
+      cerr << chrono_time() << ":  [WARNING] Reducing -l " << L2 << " -m " << M3 << " -t " << n_threads << " to -l " << plan.l
+           << " -m " << plan.m << " -t " << plan.n_threads << " to fit in --max-ram " << max_ram_gb << " GB." << endl;
+    }
+    L2 = plan.l;
+    M3 = plan.m;
+    n_threads = plan.n_threads;
+    cerr << chrono_time() << ":  [Info] Memory plan for --max-ram " << max_ram_gb << " GB:  -l " << L2 << " -m " << M3 << " -t "
+         << n_threads << ", " << SegmentContext::segments_for(n_threads, plan.n_readers) << " read segments, and up to "
+         << int(plan.match_buffer_bytes / (1 << 20)) << " MB of matches per input before "
+         << (spill_dir.empty() ? "switching to dense counters." : "spilling them to --spill-dir.") << endl;
+  }
+  if (match_buffer_mb > 0) {
+    const uint64_t match_buffer_bytes = match_buffer_mb * (1 << 20);
+    if (!(plan.n_readers)) {
+      plan.n_readers = ReadersContext::default_readers();
+    }
+    plan.match_buffer_bytes = plan.match_buffer_bytes ? min(plan.match_buffer_bytes, match_buffer_bytes) : match_buffer_bytes;
   }
 
-  if (recompute_kmer_index) {
-    db_snps.save();
-    db_kmer_index.save();
+  const auto M2 = K2 - L2;
+
+  assert(L2 > 0 && "Unsupported value of -l");
+  assert(L2 <= 32 && "Unsupported value of -l");
+  assert(M2 > 0 && "Unsupported value of -m");
+  assert(M2 < 64 && "Unsupported value of -m");
+  assert(M3 > 0 && "Unsupported value of -m");
+  assert(M3 < 64 && "Unsupported value of -m");
+
+  const auto LMER_MASK = (LSB << L2) - LSB;
+  const auto MMER_MASK = (LSB << M2) - LSB;
+  const auto MAX_BLOOM = (LSB << M3) - LSB;
+
+  // Bit vector with one presence/absence bit for every possible M3-bit kmer suffix (the M3
+  // LSBs of a kmer's nucleotide sequence).
+  DBIndex<uint64_t> db_mmer_bloom(dbroot + dbbase + "_optimized_db_mmer_bloom_" + to_string(M3) + ".bin", (1 + MAX_BLOOM) / 64);
+  const bool recompute_mmer_bloom = db_mmer_bloom.mmap();
+
+  // For every kmer in the original DB, the most-signifficant L2 bits of the kmer's nucleotide sequence
+  // are called that kmer's lmer.  Kmers that share the same lmer occupy a range of consecutive
+  // positions in the kmer_index, and that range is lmer_index[lmer].
+  DBIndex<LmerRange> db_lmer_index(dbroot + dbbase + "_optimized_db_lmer_index_" + to_string(L2) + ".bin", 1 + LMER_MASK);
+  const bool recompute_lmer_index = db_lmer_index.mmap();
+  LmerRange *lmer_index = db_lmer_index.address();
+
+  const bool recompute_everything = recompute_kmer_index || recompute_snps || recompute_lmer_index || recompute_mmer_bloom;
+
+  if (recompute_lmer_index || recompute_mmer_bloom) {
+    cerr << chrono_time() << ":  Recomputing bloom index and/or filter." << endl;
+    build_lmer_index_and_bloom(recompute_lmer_index ? lmer_index : NULL, recompute_mmer_bloom ? db_mmer_bloom.address() : NULL,
+                               kmer_db.address(), kmer_db.elementCount(), snps_db.address(), snps_db.elementCount() / 3,
+                               M2, M3);
   }
 
-  if (recompute_mmer_bloom) {
+  save_db();
+
+  // A prescreened sub-DB is not cached;  see above.
+  const bool cache_index = !(prescreen) || species.empty();
+
+  if (recompute_mmer_bloom && cache_index) {
     db_mmer_bloom.save();
   }
 
-  if (recompute_lmer_index) {
+  if (recompute_lmer_index && cache_index) {
     db_lmer_index.save();
   }
 
-  cerr << chrono_time() << ":  [Info] Done with init for optimized DB with " << db_kmer_index.elementCount() << " kmers.  That took "
+  cerr << chrono_time() << ":  [Info] Done with init for optimized DB with " << kmer_db.elementCount() << " kmers.  That took "
        << (chrono_time() - l_start) / 1000 << " seconds." << endl;
 
   l_start = chrono_time();
 
   const auto errors =
-      kmer_lookup(lmer_index, db_mmer_bloom.address(), db_kmer_index.address(), db_snps.address(), argc - optind,
-                  (const char **)argv + optind, oname, M2, M3, n_threads, dbbase, force, c_prefix);
+      kmer_lookup(lmer_index, db_mmer_bloom.address(), kmer_db.address(), snps_db.address(), input_paths.size(),
+                  input_paths.data(), oname, M2, M3, n_threads, dbbase, force, c_prefix, counters_path, perf_counters,
+                  max_ram_gb > 0 || match_buffer_mb > 0 ? &plan : NULL, snps_db.elementCount() / 3, paired || interleaved,
+                  paired ? mate_paths.data() : NULL, &snapshots, &stop, &subsample, out_format, &dict, cohort_path, spill_dir);
 
   if (fd != -1 && db_data != NULL) {
     int rc = munmap(db_data, db_filesize);
@@ -2018,3 +6083,4 @@ int main(int argc, char **argv) {
 
   return errors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+#endif // GTPRO_NO_MAIN
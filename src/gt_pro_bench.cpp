@@ -0,0 +1,420 @@
+// GTPro Query Engine Benchmark.
+//
+// For license and copyright information, please see
+// https://github.com/zjshi/gt-pro2.0/blob/master/LICENSE
+//
+// C++11 code formatted with
+//
+//     clang-format -style="{BasedOnStyle: llvm, ColumnLimit: 128}"
+//
+// Generates a small DB from the test/*.sckmers.db.tsv files and a deterministic synthetic
+// FASTQ in which some reads carry planted DB k-mers, builds the optimized index for each
+// requested -l/-m geometry with gt_pro itself, then times kmer_lookup_chunk on in-memory
+// segments, with the kernel's hot path counters on, and the full kmer_lookup pipeline at each
+// requested thread count.  It also times the sort and count of an input's matches, as in
+// write_output, with sort_runs against std::sort.  Results go to stdout as JSON;  progress and
+// gt_pro's own logging go to stderr.
+
+#define GTPRO_NO_MAIN
+#include "gt_pro.cpp"
+
+// Deterministic PRNG, so that every run benchmarks exactly the same reads.
+struct SplitMix64 {
+  uint64_t state;
+  SplitMix64(const uint64_t seed) : state(seed) {}
+  uint64_t next() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+  uint64_t below(const uint64_t n) { return next() % n; }
+};
+
+struct BenchKmer {
+  string seq;
+  uint64_t snp;
+};
+
+// Each line of test/*.sckmers.db.tsv is a 31-mer and the SNP coordinate it covers.  The SNP
+// offset within the k-mer is not recorded there, so every k-mer is encoded with offset 15.
+// The DB builder then gives conflicting k-mers of the same SNP their own virtual SNP ids,
+// which keeps lookups exact at the cost of a somewhat larger snps table than a real DB.
+constexpr auto BENCH_SNP_OFFSET = 15;
+
+vector<BenchKmer> load_bench_kmers(const vector<string> &tsv_paths) {
+  vector<BenchKmer> kmers;
+  for (auto &path : tsv_paths) {
+    ifstream fh(path);
+    if (!(fh)) {
+      cerr << chrono_time() << ":  [ERROR] Failed to open " << path << endl;
+      exit(EXIT_FAILURE);
+    }
+    string seq;
+    uint64_t snp;
+    while (fh >> seq >> snp) {
+      if (seq.size() != K || snp > SNP_MAX_REAL_ID) {
+        cerr << chrono_time() << ":  [ERROR] Malformed line in " << path << ": " << seq << endl;
+        exit(EXIT_FAILURE);
+      }
+      kmers.push_back({seq, snp});
+    }
+  }
+  return kmers;
+}
+
+void write_raw_db(const string &path, const vector<BenchKmer> &kmers) {
+  // The raw DB is sorted by k-mer, just like the output of sckmerdb_build.
+  vector<tuple<uint64_t, uint64_t>> db;
+  for (auto &bk : kmers) {
+    uint64_t kmer_tuple[2];
+    const auto malformed_dna = seq_encode<uint64_t, K>(kmer_tuple, bk.seq.c_str());
+    assert(!(malformed_dna));
+    db.push_back(make_tuple(kmer_tuple[0], (bk.snp << 8) | BENCH_SNP_OFFSET));
+  }
+  sort(db.begin(), db.end());
+  FILE *f = fopen(path.c_str(), "wb");
+  assert(f);
+  for (auto &kd : db) {
+    const uint64_t words[2] = {get<1>(kd), get<0>(kd)};
+    fwrite(words, sizeof(uint64_t), 2, f);
+  }
+  fclose(f);
+}
+
+string generate_reads(const vector<BenchKmer> &kmers, const uint64_t n_reads, const int read_length, const uint64_t seed) {
+  // Half the reads carry one planted DB k-mer, in either orientation.  About one read in ten
+  // carries a wildcard 'N', which splits it into two tokens.
+  static const char *bases = "ACGT";
+  SplitMix64 rng(seed);
+  string fastq;
+  string seq(read_length, 'A');
+  const string qual(read_length, 'I');
+  for (uint64_t i = 0; i < n_reads; ++i) {
+    for (auto &c : seq) {
+      c = bases[rng.below(4)];
+    }
+    if (read_length >= K && rng.below(2) == 0) {
+      string planted = kmers[rng.below(kmers.size())].seq;
+      if (rng.below(2)) {
+        reverse(planted.begin(), planted.end());
+        for (auto &c : planted) {
+          c = bases[3 - code_dict.data[c]];
+        }
+      }
+      seq.replace(rng.below(read_length - K + 1), K, planted);
+    }
+    if (rng.below(10) == 0) {
+      seq[rng.below(read_length)] = 'N';
+    }
+    fastq += "@bench_read_" + to_string(i) + "\n" + seq + "\n+\n" + qual + "\n";
+  }
+  return fastq;
+}
+
+struct Geometry {
+  int L2;
+  int M3;
+};
+
+// Matches as write_output would sort them:  n_keys hits on the SNPs of the DB k-mers, with SNP
+// coverage following Zipf's law over a random order of SNPs, as a few abundant species and
+// strains collect most of the hits in a metagenome.
+vector<uint64_t> generate_matches(const vector<BenchKmer> &kmers, const uint64_t n_keys, const uint64_t seed) {
+  vector<uint64_t> snps;
+  for (const auto &k : kmers) {
+    snps.push_back(k.snp);
+  }
+  sort(snps.begin(), snps.end());
+  snps.erase(unique(snps.begin(), snps.end()), snps.end());
+  SplitMix64 rng(seed);
+  for (uint64_t i = snps.size(); i > 1; --i) {
+    swap(snps[i - 1], snps[rng.below(i)]);
+  }
+  vector<double> cumulative(snps.size());
+  double total = 0;
+  for (uint64_t i = 0; i < snps.size(); ++i) {
+    total += 1.0 / (i + 1);
+    cumulative[i] = total;
+  }
+  vector<uint64_t> keys(n_keys);
+  for (auto &key : keys) {
+    const double x = total * (rng.next() >> 11) / double(LSB << 53);
+    key = snps[min<uint64_t>(lower_bound(cumulative.begin(), cumulative.end(), x) - cumulative.begin(), snps.size() - 1)];
+  }
+  return keys;
+}
+
+// Build the lmer index and bloom filter for the given geometry by running gt_pro on empty input.
+bool build_optimized_db(const string &gt_pro_path, const string &db_path, const Geometry &g) {
+  Command cmd(gt_pro_path + " -d " + db_path + " -l " + to_string(g.L2) + " -m " + to_string(g.M3) +
+              " </dev/null 2>/dev/null >/dev/null; echo $?");
+  cmd.run(false);
+  return cmd.success && cmd.output == "0";
+}
+
+void display_usage(const char *fname) {
+  cerr << "usage: " << fname << " [-w work_dir] [-x gt_pro_path] [-n n_reads] [-r read_length] [-s seed] [-k n_matches]\n"
+       << "       [-g L2:M3 ...] [-t n_threads ...] [-p] [test/DDDDDD.sckmers.db.tsv ...]\n"
+       << "\n"
+       << "  -w <scratch dir for the generated DB, index, reads and outputs; default ./bench_work>\n"
+       << "  -x <gt_pro binary used to build the optimized index; default ./gt_pro>\n"
+       << "  -n <number of synthetic reads; default 500000>\n"
+       << "  -r <synthetic read length, at least 1; default 150>\n"
+       << "  -s <PRNG seed; default 1>\n"
+       << "  -k <number of matches to sort; default 32 million>\n"
+       << "  -g <index geometry to benchmark, repeatable; default 24:28>\n"
+       << "  -t <thread count for the full pipeline, repeatable; default 1, 2, 4 and CPU_count>\n"
+       << "  -p <only write the DB and reads to work_dir, for make check, and exit>\n"
+       << "\n"
+       << "DB k-mers are taken from test/*.sckmers.db.tsv unless other files are given.  The default\n"
+       << "geometry keeps the lmer index at 128 MB;  -g 28:31 times the specialized kernel of the\n"
+       << "smallest tuned geometry, with a 2 GB lmer index.\n";
+}
+
+int main(int argc, char **argv) {
+  errno = 0;
+
+  string work_dir = "./bench_work";
+  string gt_pro_path = "./gt_pro";
+  uint64_t n_reads = 500 * 1000;
+  int read_length = 150;
+  uint64_t seed = 1;
+  uint64_t n_matches = 32 * 1000 * 1000;
+  vector<Geometry> geometries;
+  vector<int> thread_counts;
+  bool prepare_only = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:x:n:r:s:k:g:t:ph")) != -1) {
+    switch (opt) {
+    case 'w':
+      work_dir = optarg;
+      break;
+    case 'x':
+      gt_pro_path = optarg;
+      break;
+    case 'n':
+      n_reads = stoull(optarg);
+      break;
+    case 'r': {
+      char *end = NULL;
+      const long length = strtol(optarg, &end, 10);
+      if (end == optarg || *end || length < 1 || length > numeric_limits<int>::max()) {
+        cerr << "malformed argument: -r " << optarg << "\n";
+        display_usage(argv[0]);
+        exit(EXIT_FAILURE);
+      }
+      read_length = length;
+      break;
+    }
+    case 's':
+      seed = stoull(optarg);
+      break;
+    case 'k':
+      n_matches = stoull(optarg);
+      break;
+    case 'g': {
+      Geometry g;
+      if (sscanf(optarg, "%d:%d", &g.L2, &g.M3) != 2 || g.L2 <= 0 || g.L2 > 32 || g.M3 < 6 || g.M3 >= 64) {
+        cerr << "malformed argument: -g " << optarg << "\n";
+        exit(EXIT_FAILURE);
+      }
+      geometries.push_back(g);
+      break;
+    }
+    case 't':
+      thread_counts.push_back(max(1, stoi(optarg)));
+      break;
+    case 'p':
+      prepare_only = true;
+      break;
+    case 'h':
+    case '?':
+      display_usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (geometries.empty()) {
+    // Generic kernel, small index;  28:31 and up build GB-sized indexes, so they are opt-in.
+    geometries.push_back({24, 28});
+  }
+  if (thread_counts.empty()) {
+    for (int t : {1, 2, 4, int(thread::hardware_concurrency())}) {
+      if (t > 0 && find(thread_counts.begin(), thread_counts.end(), t) == thread_counts.end()) {
+        thread_counts.push_back(t);
+      }
+    }
+  }
+  vector<string> tsv_paths(argv + optind, argv + argc);
+  if (tsv_paths.empty()) {
+    tsv_paths = {"test/275577.sckmers.db.tsv", "test/276044.sckmers.db.tsv"};
+  }
+
+  Command mkdir_cmd("mkdir -p '" + work_dir + "'");
+  mkdir_cmd.run();
+  if (!(mkdir_cmd.success)) {
+    cerr << chrono_time() << ":  [ERROR] Failed to create work dir " << work_dir << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  const auto kmers = load_bench_kmers(tsv_paths);
+  const string db_path = work_dir + "/bench_db.bin";
+  const string dbbase = "bench_db";
+  write_raw_db(db_path, kmers);
+  cerr << chrono_time() << ":  [Info] Wrote " << kmers.size() << " k-mers to " << db_path << endl;
+
+  // Stale optimized files from a different DB would fail the size checks in DBIndex.
+  Command rm_cmd("/bin/rm -f '" + work_dir + "/" + dbbase + "_optimized_db_'*.bin");
+  rm_cmd.run();
+
+  const string fastq = generate_reads(kmers, n_reads, read_length, seed);
+  const string reads_path = work_dir + "/bench_reads.fastq";
+  {
+    ofstream fh(reads_path, ofstream::out | ofstream::binary);
+    fh << fastq;
+  }
+  cerr << chrono_time() << ":  [Info] Wrote " << n_reads << " synthetic reads to " << reads_path << endl;
+  if (prepare_only) {
+    return 0;
+  }
+
+  ostringstream json;
+  json << "{\n"
+       << "  \"db_kmers\": " << kmers.size() << ",\n"
+       << "  \"reads\": " << n_reads << ",\n"
+       << "  \"read_length\": " << read_length << ",\n"
+       << "  \"seed\": " << seed << ",\n"
+       << "  \"runs\": [";
+  bool first_run = true;
+  auto begin_run = [&](const char *stage, const Geometry &g, const int n_threads) {
+    json << (first_run ? "\n" : ",\n") << "    {\"stage\": \"" << stage << "\", \"l\": " << g.L2 << ", \"m\": " << g.M3
+         << ", \"threads\": " << n_threads;
+    first_run = false;
+  };
+
+  bool failed = false;
+  for (auto &g : geometries) {
+    if (!(build_optimized_db(gt_pro_path, db_path, g))) {
+      cerr << chrono_time() << ":  [ERROR] Failed to build index -l " << g.L2 << " -m " << g.M3 << " with " << gt_pro_path
+           << endl;
+      failed = true;
+      continue;
+    }
+    const int M2 = K2 - g.L2;
+    const string prefix = work_dir + "/" + dbbase + "_optimized_db_";
+    DBIndex<uint64_t> db_snps(prefix + "snps.bin");
+    DBIndex<uint32_t> db_kmer_index(prefix + "kmer_index.bin");
+    DBIndex<uint64_t> db_mmer_bloom(prefix + "mmer_bloom_" + to_string(g.M3) + ".bin", (LSB << g.M3) / 64);
+    DBIndex<LmerRange> db_lmer_index(prefix + "lmer_index_" + to_string(g.L2) + ".bin", LSB << g.L2);
+    if (db_snps.mmap(false) || db_kmer_index.mmap(false) || db_mmer_bloom.mmap(false) || db_lmer_index.mmap(false)) {
+      failed = true;
+      continue;
+    }
+    const auto lmer_index = db_lmer_index.address();
+    const auto mmer_bloom = db_mmer_bloom.address();
+    const auto kmers_index = db_kmer_index.address();
+    const auto snps = db_snps.address();
+    uint64_t n_kmers = 0;
+
+    // Query kernel alone, single threaded, over in-memory segments cut the same way scan_input cuts them.
+    {
+      vector<char> segment(SEGMENT_SIZE);
+      QueryCounters qc;
+      uint64_t matches = 0;
+      int64_t reads_scanned = 0;
+      long elapsed_ms = 0;
+      for (uint64_t pos = 0; pos < fastq.size();) {
+        uint64_t size = min<uint64_t>(SEGMENT_SIZE, fastq.size() - pos);
+        memcpy(segment.data(), fastq.data() + pos, size);
+        if (size == SEGMENT_SIZE) {
+          size = last_record(segment.data(), size, FORMAT_FASTQ) - segment.data();
+        }
+        vector<uint64_t> kmt;
+        const auto t_start = chrono_time();
+        const auto n = kmer_lookup_chunk(&kmt, lmer_index, mmer_bloom, kmers_index, snps, segment.data(), size, M2, g.M3,
+                                         reads_path, t_start, &qc);
+        elapsed_ms += chrono_time() - t_start;
+        assert(n >= 0);
+        reads_scanned += n;
+        matches += kmt.size();
+        pos += size;
+      }
+      const double secs = max(elapsed_ms, 1L) / 1000.0;
+      begin_run("kmer_lookup_chunk", g, 1);
+      json << ", \"seconds\": " << secs << ", \"reads_per_sec\": " << uint64_t(reads_scanned / secs)
+           << ", \"ns_per_kmer\": " << (secs * 1e9) / max<uint64_t>(qc.kmers, 1) << ", \"kmers\": " << qc.kmers
+           << ", \"bloom_hit_rate\": " << double(qc.bloom_passes) / max<uint64_t>(qc.kmers, 1)
+           << ", \"avg_bucket_scan\": " << double(qc.bucket_entries) / max<uint64_t>(qc.lmer_probes, 1)
+           << ", \"matches\": " << qc.matches << ", \"snp_hits\": " << matches << "}";
+      n_kmers = qc.kmers;
+    }
+
+    // Full pipeline:  file input, segment scheduling, query threads, sort and output.
+    for (const int n_threads : thread_counts) {
+      const char *input_paths[] = {reads_path.c_str()};
+      string o_name = work_dir + "/bench_out_l" + to_string(g.L2) + "_m" + to_string(g.M3) + "_t" + to_string(n_threads);
+      const auto t_start = chrono_time();
+      const auto errors = kmer_lookup(lmer_index, mmer_bloom, kmers_index, snps, 1, input_paths, &o_name[0], M2, g.M3,
+                                      n_threads, dbbase, true, "");
+      const double secs = max(chrono_time() - t_start, 1L) / 1000.0;
+      failed = failed || errors;
+      begin_run("kmer_lookup", g, n_threads);
+      json << ", \"seconds\": " << secs << ", \"reads_per_sec\": " << uint64_t(n_reads / secs)
+           << ", \"ns_per_kmer\": " << (secs * 1e9) / max<uint64_t>(n_kmers, 1)
+           << ", \"error\": " << (errors ? "true" : "false") << "}";
+    }
+  }
+  // Sort and count of one input's matches, as in write_output.  std::sort runs single threaded
+  // there, so it is timed once;  sort_runs at each thread count.
+  {
+    const auto matches = generate_matches(kmers, n_matches, seed);
+    vector<uint64_t> expected_ids, expected_counts;
+    auto sort_run = [&](const char *stage, const int n_threads) {
+      vector<uint64_t> keys(matches);
+      vector<uint64_t> scratch;
+      SortedRuns runs;
+      vector<uint64_t> ids, counts;
+      const auto t_start = steady_time_us();
+      if (n_threads == 0) {
+        sort(keys.begin(), keys.end());
+        for (uint64_t i = 0; i < keys.size();) {
+          auto j = i + 1;
+          while (j < keys.size() && keys[j] == keys[i]) {
+            ++j;
+          }
+          ids.push_back(keys[i]);
+          counts.push_back(j - i);
+          i = j;
+        }
+      } else {
+        sort_runs(keys, scratch, n_threads, true, runs);
+        runs.for_each([&](const uint64_t id, const uint64_t count) {
+          ids.push_back(id);
+          counts.push_back(count);
+          return true;
+        });
+      }
+      const double secs = max(steady_time_us() - t_start, 1L) / 1e6;
+      if (n_threads == 0) {
+        expected_ids.swap(ids);
+        expected_counts.swap(counts);
+      } else if (ids != expected_ids || counts != expected_counts) {
+        cerr << chrono_time() << ":  [ERROR] sort_runs with " << n_threads << " threads disagrees with std::sort" << endl;
+        failed = true;
+      }
+      json << (first_run ? "\n" : ",\n") << "    {\"stage\": \"" << stage << "\", \"threads\": " << max(n_threads, 1)
+           << ", \"matches\": " << matches.size() << ", \"distinct\": " << expected_ids.size() << ", \"seconds\": " << secs
+           << ", \"ns_per_match\": " << secs * 1e9 / max<uint64_t>(matches.size(), 1) << "}";
+      first_run = false;
+    };
+    sort_run("std_sort", 0);
+    for (const int n_threads : thread_counts) {
+      sort_run("sort_runs", n_threads);
+    }
+  }
+  json << "\n  ]\n}\n";
+  cout << json.str();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
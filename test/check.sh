@@ -0,0 +1,84 @@
+#!/bin/bash
+# Regression checks for 'make check'.  Builds the DB of test/*.sckmers.db.tsv and deterministic
+# synthetic reads with gt_pro_bench -p, genotypes those reads and test/SRR413665_2.fastq.gz, and
+# asserts that the output matches the golden files in test/ at -t 1 and at -t N, when matches
+# spill to --spill-dir or fold into dense counters, and when written as binary and printed with
+# gt_pro view.  The goldens are the output of the original gt_pro on the same DB and reads.
+#
+# Usage:  test/check.sh [gt_pro] [gt_pro_bench] [work_dir] [N]
+
+GT_PRO=${1:-./gt_pro}
+GT_PRO_BENCH=${2:-./gt_pro_bench}
+WORK=${3:-./check_work}
+N=${4:-4}
+
+# A buffer of about 650 matches per input, which the synthetic reads outgrow:  their matches
+# spill to several runs, or fold into dense counters.
+TINY_BUFFER_MB=0.01
+
+failures=0
+
+fail() {
+  echo "FAIL:  $*"
+  failures=$((failures + 1))
+}
+
+# genotype <output prefix> <input> [gt_pro options ...]
+genotype() {
+  local prefix=$1
+  local input=$2
+  shift 2
+  "$GT_PRO" -d "$WORK/bench_db.bin" -l 24 -m 28 -f -o "$WORK/$prefix.%{n}" "$@" "$input" 2>"$WORK/$prefix.log" ||
+    fail "gt_pro $* $input exited with an error;  see $WORK/$prefix.log"
+}
+
+# expect <output> <golden> <what>
+expect() {
+  if cmp -s "$1" "$2"; then
+    echo "ok:  $3"
+  else
+    fail "$3:  $1 differs from $2"
+  fi
+}
+
+rm -rf "$WORK"
+mkdir -p "$WORK/spill" || exit 1
+"$GT_PRO_BENCH" -p -n 20000 -s 1 -w "$WORK" 2>"$WORK/bench.log" || {
+  echo "FAIL:  $GT_PRO_BENCH -p could not build the DB and reads;  see $WORK/bench.log"
+  exit 1
+}
+READS="$WORK/bench_reads.fastq"
+GOLDEN=test/check_synthetic.tsv
+
+genotype t1 "$READS" -t 1
+expect "$WORK/t1.0.tsv" $GOLDEN "default output at -t 1"
+
+genotype tn "$READS" -t "$N"
+expect "$WORK/tn.0.tsv" $GOLDEN "default output at -t $N"
+
+genotype spill "$READS" -t "$N" --spill-dir "$WORK/spill" --match-buffer-mb $TINY_BUFFER_MB
+expect "$WORK/spill.0.tsv" $GOLDEN "output after --spill-dir at -t $N"
+if [ -n "$(ls -A "$WORK/spill")" ]; then
+  fail "spilled runs were left behind in $WORK/spill"
+fi
+
+genotype dense "$READS" -t "$N" --match-buffer-mb $TINY_BUFFER_MB
+grep -q "switching to dense counters" "$WORK/dense.log" || fail "the dense counters were not used;  see $WORK/dense.log"
+expect "$WORK/dense.0.tsv" $GOLDEN "output through dense counters at -t $N"
+
+genotype binary "$READS" -t "$N" --out-format binary
+"$GT_PRO" view "$WORK/binary.0.gtpb" >"$WORK/binary.0.tsv" 2>>"$WORK/binary.log" || fail "gt_pro view failed"
+expect "$WORK/binary.0.tsv" $GOLDEN "gt_pro view of --out-format binary at -t $N"
+
+# A real, gzipped FASTQ;  its output is compressed like its input.
+for t in 1 "$N"; do
+  genotype srr$t test/SRR413665_2.fastq.gz -t "$t"
+  gzip -dc "$WORK/srr$t.0.tsv.gz" >"$WORK/srr$t.0.tsv" 2>/dev/null
+  expect "$WORK/srr$t.0.tsv" test/check_SRR413665_2.tsv "output for test/SRR413665_2.fastq.gz at -t $t"
+done
+
+if [ $failures -gt 0 ]; then
+  echo "$failures check(s) failed."
+  exit 1
+fi
+echo "All checks passed."